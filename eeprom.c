@@ -20,6 +20,7 @@
 #include <compiler_defs.h>
 #include "flash.h"
 #include "eeprom_config.h"
+#include "eeprom.h"
 
 
 enum {
@@ -46,12 +47,368 @@ struct page_info{
 };
 
 /* EEPROM bitmap operation macro definition*/
-#define EE_SET_BITMAP(addr) eeprom_bitmap[(addr) >> 3] |= 1 << ((addr) % 8)
-#define EE_CLR_BITMAP(addr) eeprom_bitmap[(addr) >> 3] &= ~(1 << ((addr) % 8))
-#define EE_GET_BITMAP(addr) (eeprom_bitmap[(addr) >> 3] & (1 << ((addr) % 8)))
+#define EE_SET_BITMAP(map, addr) (map)[(addr) >> 3] |= 1 << ((addr) % 8)
+#define EE_CLR_BITMAP(map, addr) (map)[(addr) >> 3] &= ~(1 << ((addr) % 8))
+#define EE_GET_BITMAP(map, addr) ((map)[(addr) >> 3] & (1 << ((addr) % 8)))
+
+/* Record key access, with EE_ADDR16 the key spans the first two bytes*/
+#if EE_ADDR16
+#define EE_READ_KEY(phy_addr)             eeprom_read_key(phy_addr)
+#define EE_WRITE_KEY(phy_addr, key)       eeprom_write_key(phy_addr, key)
+#define EE_FIND_RECORD(from, to, log_addr) eeprom_find_record(from, to, log_addr)
+#else
+#define EE_READ_KEY(phy_addr)             flash_read_byte(phy_addr)
+#define EE_WRITE_KEY(phy_addr, key)       flash_write_byte(phy_addr, key)
+#define EE_FIND_RECORD(from, to, log_addr) flash_find_back(from, to, log_addr)
+#endif
 
 static struct page_info page;
 
+/* Set by eeprom_init_readonly(), every flash program or erase is rejected*/
+static bit ee_readonly;
+
+#if EE_WRITE_ELIDE
+/* Number of writes skipped since the value was already stored*/
+static SEGMENT_VARIABLE(ee_elided, U16, SEG_XDATA);
+#endif
+
+#if EE_SHADOW_ENABLE
+/* RAM copy of the emulated EEPROM contents, valid after eeprom_init()*/
+static SEGMENT_VARIABLE(ee_shadow[EE_SIZE], U8, SEG_XDATA);
+#endif
+
+#if EE_BITMAP_ENABLE
+/* Bit set for every address which has a record in active page*/
+static SEGMENT_VARIABLE(ee_valid_map[EE_BITMAP_SIZE], U8, SEG_XDATA);
+#endif
+
+#if EE_LAYOUT != EE_LAYOUT_SLOTS
+/* Address bitmap of the page copy, the ring log advance and the block scans.
+ * None of them runs inside another one*/
+static SEGMENT_VARIABLE(ee_scratch_map[EE_BITMAP_SIZE], U8, SEG_XDATA);
+#endif
+
+#if EE_LRU_ENTRIES
+/* Micro cache entries, most recently used first. Unused entry holds
+ * EE_ADDR_NONE*/
+static SEGMENT_VARIABLE(lru_addr[EE_LRU_ENTRIES], EE_ADDR, SEG_XDATA);
+static SEGMENT_VARIABLE(lru_data[EE_LRU_ENTRIES], U8, SEG_XDATA);
+static SEGMENT_VARIABLE(lru_hits, U16, SEG_XDATA);
+static SEGMENT_VARIABLE(lru_misses, U16, SEG_XDATA);
+
+/**
+ * @fn static void eeprom_lru_reset(void)
+ * @brief drop all micro cache entries
+ *
+ * @return none
+ */
+static void eeprom_lru_reset(void)
+{
+	U8 i;
+	for (i = 0; i < EE_LRU_ENTRIES; i++) {
+		lru_addr[i] = EE_ADDR_NONE;
+	}
+}
+
+/**
+ * @fn static void eeprom_lru_put(EE_ADDR log_addr, U8 byte)
+ * @brief insert an address in front of micro cache, drop least recently
+ *  used entry.
+ *
+ * @param log_addr address in eeprom
+ * @param byte current value of the address
+ *
+ * @return none
+ */
+static void eeprom_lru_put(EE_ADDR log_addr, U8 byte)
+{
+	U8 i;
+	for (i = EE_LRU_ENTRIES - 1; i > 0; i--) {
+		lru_addr[i] = lru_addr[i - 1];
+		lru_data[i] = lru_data[i - 1];
+	}
+	lru_addr[0] = log_addr;
+	lru_data[0] = byte;
+}
+
+/**
+ * @fn static U8 eeprom_lru_get(EE_ADDR log_addr, U8 *byte)
+ * @brief look up an address in micro cache, move the hit entry to front.
+ *
+ * @param log_addr address in eeprom
+ * @param *byte pointer to cached value
+ *
+ * @return TRUE: hit; FALSE: miss
+ */
+static U8 eeprom_lru_get(EE_ADDR log_addr, U8 *byte)
+{
+	U8 i;
+	for (i = 0; i < EE_LRU_ENTRIES; i++) {
+		if (lru_addr[i] == log_addr) {
+			*byte = lru_data[i];
+			for (; i > 0; i--) {
+				lru_addr[i] = lru_addr[i - 1];
+				lru_data[i] = lru_data[i - 1];
+			}
+			lru_addr[0] = log_addr;
+			lru_data[0] = *byte;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/**
+ * @fn static void eeprom_lru_update(EE_ADDR log_addr, U8 byte)
+ * @brief write through, update the entry of an address if it is cached.
+ *
+ * @param log_addr address in eeprom
+ * @param byte new value of the address
+ *
+ * @return none
+ */
+static void eeprom_lru_update(EE_ADDR log_addr, U8 byte)
+{
+	U8 i;
+	for (i = 0; i < EE_LRU_ENTRIES; i++) {
+		if (lru_addr[i] == log_addr) {
+			lru_data[i] = byte;
+			return;
+		}
+	}
+}
+#endif
+
+#if EE_WRITE_BACK
+/* Pending writes in arrival order, one entry per address*/
+static SEGMENT_VARIABLE(wb_addr[EE_WB_ENTRIES], EE_ADDR, SEG_XDATA);
+static SEGMENT_VARIABLE(wb_data[EE_WB_ENTRIES], U8, SEG_XDATA);
+static SEGMENT_VARIABLE(wb_count, U8, SEG_XDATA);
+static SEGMENT_VARIABLE(wb_age, U8, SEG_XDATA);
+static SEGMENT_VARIABLE(wb_coalesced, U16, SEG_XDATA);
+static SEGMENT_VARIABLE(wb_flushed, U16, SEG_XDATA);
+
+/**
+ * @fn static U8 eeprom_wb_find(EE_ADDR log_addr)
+ * @brief look up a pending write of an address
+ *
+ * @param log_addr address in eeprom
+ *
+ * @return buffer index, wb_count if the address is not pending
+ */
+static U8 eeprom_wb_find(EE_ADDR log_addr)
+{
+	U8 i;
+	for (i = 0; i < wb_count; i++) {
+		if (wb_addr[i] == log_addr)
+			break;
+	}
+	return i;
+}
+
+/**
+ * @fn static void eeprom_wb_drop(EE_ADDR start, U8 len)
+ * @brief discard pending writes of an address range which is about to be
+ *  written directly.
+ *
+ * @param start first address in eeprom
+ * @param len number of bytes
+ *
+ * @return none
+ */
+static void eeprom_wb_drop(EE_ADDR start, U8 len)
+{
+	U8 i, j;
+	for (i = 0, j = 0; i < wb_count; i++) {
+		if ((wb_addr[i] >= start) && (wb_addr[i] - start < len))
+			continue;
+		wb_addr[j] = wb_addr[i];
+		wb_data[j] = wb_data[i];
+		j++;
+	}
+	wb_count = j;
+}
+#endif
+
+#if EE_BLOBS
+/* Offset of the latest committed record of every blob in active page, 0 if
+ * there is none*/
+static SEGMENT_VARIABLE(blob_pos[EE_BLOBS], U16, SEG_XDATA);
+#endif
+
+#if EE_ADDR16
+/**
+ * @fn static EE_ADDR eeprom_read_key(U16 phy_addr)
+ * @brief decode the address key of a record.
+ *
+ * A key byte above 0x7F is a blank or transaction begin key, its low byte is
+ * not used. A blank low byte after a programmed high byte is a torn key.
+ *
+ * @param phy_addr record physical address
+ *
+ * @return address, EE_ADDR_NONE, EE_TX_BEGIN, or EE_SIZE for a torn key
+ */
+static EE_ADDR eeprom_read_key(U16 phy_addr)
+{
+	U8 hi, lo;
+
+	hi = flash_read_byte(phy_addr);
+	if (hi & 0x80)
+		return 0xFF00 | hi;
+	lo = flash_read_byte(phy_addr + 1);
+	if (lo & 0x80)
+		return EE_SIZE;
+	return ((EE_ADDR)hi << 7) | lo;
+}
+
+/**
+ * @fn static void eeprom_write_key(U16 phy_addr, EE_ADDR key)
+ * @brief program the address key of a record, high byte first.
+ *
+ * @param phy_addr record physical address
+ * @param key address or EE_TX_BEGIN
+ *
+ * @return none
+ */
+static void eeprom_write_key(U16 phy_addr, EE_ADDR key)
+{
+	if (key < EE_SIZE) {
+		flash_write_byte(phy_addr, key >> 7);
+		flash_write_byte(phy_addr + 1, key & 0x7F);
+	} else {
+		flash_write_byte(phy_addr, (U8)key);
+	}
+}
+
+/**
+ * @fn static U16 eeprom_find_record(U16 from, U16 to, EE_ADDR log_addr)
+ * @brief search backward for the latest record of an address.
+ *
+ * flash_find_back() matches the high key byte, the low byte is compared
+ * here and the search goes on below a record which does not match.
+ *
+ * @param from physical address of the last record to check
+ * @param to physical address of the first record to check
+ * @param log_addr address in eeprom
+ *
+ * @return record physical address, 0 if none
+ */
+static U16 eeprom_find_record(U16 from, U16 to, EE_ADDR log_addr)
+{
+	while ((from = flash_find_back(from, to, log_addr >> 7)) != 0) {
+		if (flash_read_byte(from + 1) == (log_addr & 0x7F))
+			return from;
+		if (from < to + EE_VARIABLE_SIZE)
+			break;
+		from -= EE_VARIABLE_SIZE;
+	}
+	return 0;
+}
+#endif
+
+#if EE_TX_ENABLE
+/* Writes of the open transaction, one entry per address*/
+static SEGMENT_VARIABLE(tx_addr[EE_TX_ENTRIES], EE_ADDR, SEG_XDATA);
+static SEGMENT_VARIABLE(tx_data[EE_TX_ENTRIES], U8, SEG_XDATA);
+static SEGMENT_VARIABLE(tx_count, U8, SEG_XDATA);
+static bit tx_open;
+#endif
+
+#if EE_ERASE_QUEUE
+/* Bit set for every replaced page which waits for eeprom_idle_erase() or an
+ * erase step of eeprom_maintenance()*/
+static SEGMENT_VARIABLE(erase_map[(EE_PAGES + 7) / 8], U8, SEG_XDATA);
+#endif
+
+#if EE_WEAR_LEVEL
+/* Erase count of every page, read at mount and kept by eeprom_format_page()*/
+static SEGMENT_VARIABLE(wear_count[EE_PAGES], U32, SEG_XDATA);
+#endif
+
+#if EE_RING_LOG
+/* Index of the oldest page of the ring log, page.idx is the newest one*/
+static SEGMENT_VARIABLE(ring_old, U8, SEG_XDATA);
+
+/**
+ * @fn static U16 eeprom_ring_seq(U16 phy_addr)
+ * @brief read the sequence number of a page in the ring log.
+ *
+ * @param phy_addr page physical address
+ *
+ * @return sequence number, 0xFFFF for a page which has none yet
+ */
+static U16 eeprom_ring_seq(U16 phy_addr)
+{
+	return ((U16)flash_read_byte(phy_addr + EE_SEQ_OFFSET) << 8) |
+	       flash_read_byte(phy_addr + EE_SEQ_OFFSET + 1);
+}
+#endif
+
+#if EE_GC_RESERVE
+/* Incremental compaction: destination page, its write pointer and next
+ * address to copy. gc_dest is 0 when no compaction is running*/
+static SEGMENT_VARIABLE(gc_dest, U16, SEG_XDATA);
+static SEGMENT_VARIABLE(gc_tail, U16, SEG_XDATA);
+static SEGMENT_VARIABLE(gc_next, EE_ADDR, SEG_XDATA);
+
+/**
+ * @fn static void eeprom_gc_abort(void)
+ * @brief give up the running compaction, its page is queued for erase.
+ *
+ * @return none
+ */
+static void eeprom_gc_abort(void)
+{
+	EE_SET_BITMAP(erase_map, (gc_dest - EE_BASE_ADDR) / EE_PAGE_SIZE);
+	gc_dest = 0;
+}
+
+/**
+ * @fn static U8 eeprom_gc_put(EE_ADDR log_addr, U8 byte)
+ * @brief append a record to the page being compacted and read it back.
+ *
+ * @param log_addr address in eeprom
+ * @param byte value written
+ *
+ * @return 0: success; 1: error, record reads back wrong and the compaction
+ *  is given up
+ */
+static U8 eeprom_gc_put(EE_ADDR log_addr, U8 byte)
+{
+	U16 phy_addr = gc_dest + gc_tail;
+	EE_WRITE_KEY(phy_addr, log_addr);
+	flash_write_byte(phy_addr + EE_DATA_OFFSET, byte);
+	gc_tail += EE_VARIABLE_SIZE;
+	if ((EE_READ_KEY(phy_addr) != log_addr) ||
+	    (flash_read_byte(phy_addr + EE_DATA_OFFSET) != byte)) {
+		eeprom_gc_abort();
+		return ERROR;
+	}
+	return SUCCESS;
+}
+#endif
+
+
+/**
+ * @fn static U32 eeprom_erase_count(U16 phy_addr)
+ * @brief read erase count from page TAG, a page which was never formatted
+ *  counts 0.
+ *
+ * @param phy_addr physical page address
+ *
+ * @return erase count
+ */
+static U32 eeprom_erase_count(U16 phy_addr)
+{
+	UU32 erase_count;
+	erase_count.U8[b3] = 0;
+	erase_count.U8[b2] = flash_read_byte(phy_addr + 1);
+	erase_count.U8[b1] = flash_read_byte(phy_addr + 2);
+	erase_count.U8[b0] = flash_read_byte(phy_addr + 3);
+	if (0xFFFFFF == erase_count.U32)
+		return 0;
+	return erase_count.U32;
+}
 
 /**
  * @fn static void eeprom_format_page(U16 phy_addr)
@@ -65,18 +422,45 @@ static struct page_info page;
 static void eeprom_format_page(U16 phy_addr)
 {
 	UU32 erase_count;
-	/* Ignore first byte in page, it is flash status byte*/
-	erase_count.U8[0] = 0;
-	erase_count.U8[1] = flash_read_byte(phy_addr + 1);
-	erase_count.U8[2] = flash_read_byte(phy_addr + 2);
-	erase_count.U8[3] = flash_read_byte(phy_addr + 3);
+#if EE_VPAGE_PAGES > 1
+	U8 i;
+#endif
+	/* Ignore first byte in page, it is flash status byte. Count is stored
+	 * most significant byte first, b0..b3 keep it compiler independent*/
+	erase_count.U8[b3] = 0;
+	erase_count.U8[b2] = flash_read_byte(phy_addr + 1);
+	erase_count.U8[b1] = flash_read_byte(phy_addr + 2);
+	erase_count.U8[b0] = flash_read_byte(phy_addr + 3);
 	erase_count.U32 += 1;
 
 	flash_erase_page(phy_addr);
+#if EE_VPAGE_PAGES > 1
+	/* Status byte is gone first, a reset in between leaves a page which is
+	 * not formatted and is formatted again at mount*/
+	for (i = 1; i < EE_VPAGE_PAGES; i++) {
+		flash_erase_page(phy_addr + i * FL_PAGE_SIZE);
+	}
+#endif
 
-	flash_write_byte(phy_addr + 1, erase_count.U8[1]);
-	flash_write_byte(phy_addr + 2, erase_count.U8[2]);
-	flash_write_byte(phy_addr + 3, erase_count.U8[3]);
+	flash_write_byte(phy_addr + 1, erase_count.U8[b2]);
+	flash_write_byte(phy_addr + 2, erase_count.U8[b1]);
+	flash_write_byte(phy_addr + 3, erase_count.U8[b0]);
+#if EE_WEAR_LEVEL
+	erase_count.U8[b3] = 0;
+	wear_count[(phy_addr - EE_BASE_ADDR) / EE_PAGE_SIZE] = erase_count.U32;
+#endif
+}
+
+/**
+ * @fn static U8 eeprom_is_blank(U16 phy_addr)
+ * @brief Check every byte after page tag is erased.
+ *
+ * @param phy_addr page physical address
+ * @return TRUE: data area is blank; FALSE: data area is not blank
+ */
+static U8 eeprom_is_blank(U16 phy_addr)
+{
+    return flash_is_blank(phy_addr + EE_TAG_SIZE, EE_PAGE_SIZE - EE_TAG_SIZE);
 }
 
 /**
@@ -88,26 +472,126 @@ static void eeprom_format_page(U16 phy_addr)
  */
 static U8 eeprom_is_formatted(U16 phy_addr)
 {
-    U16 i;
     UU32 tag;
-    tag.U8[0] = flash_read_byte(phy_addr++);
-    tag.U8[1] = flash_read_byte(phy_addr++);
-    tag.U8[2] = flash_read_byte(phy_addr++);
-    tag.U8[3] = flash_read_byte(phy_addr++);
+    tag.U8[0] = flash_read_byte(phy_addr);
+    tag.U8[1] = flash_read_byte(phy_addr + 1);
+    tag.U8[2] = flash_read_byte(phy_addr + 2);
+    tag.U8[3] = flash_read_byte(phy_addr + 3);
 
     /* Change status is erased or erase count not equal 0xFFFFFF*/
     if((tag.U8[0] != PAGE_STATUS_ERASED) ||
-      ((tag.U8[1] == 0xFF)&&(tag.U8[2] = 0xFF)&&(tag.U8[3] = 0xFF))) {
+      ((tag.U8[1] == 0xFF)&&(tag.U8[2] == 0xFF)&&(tag.U8[3] == 0xFF))) {
     	return FALSE;
     }
+    return eeprom_is_blank(phy_addr);
+}
 
-    for (i = EE_TAG_SIZE; i < FL_PAGE_SIZE; i++) {
-        if (flash_read_byte(phy_addr++) != 0xFF) {
-            return FALSE;
-        }
-    }
-    return TRUE;
+/**
+ * @fn static void eeprom_check_spare(U16 phy_addr)
+ * @brief format a spare page which is not blank.
+ *
+ * With EE_FAST_MOUNT the spare pages are not checked at mount, so it is done
+ * right before a page receives data.
+ *
+ * @param phy_addr page physical address
+ *
+ * @return none
+ */
+static void eeprom_check_spare(U16 phy_addr)
+{
+#if EE_ERASE_QUEUE
+	U8 idx = (phy_addr - EE_BASE_ADDR) / EE_PAGE_SIZE;
+	if (EE_GET_BITMAP(erase_map, idx)) {
+		eeprom_format_page(phy_addr);
+		EE_CLR_BITMAP(erase_map, idx);
+		return;
+	}
+#endif
+#if EE_FAST_MOUNT
+	if (!eeprom_is_formatted(phy_addr))
+		eeprom_format_page(phy_addr);
+#endif
+}
+
+#if EE_ERASE_QUEUE
+/**
+ * @fn static void eeprom_queue_erase(U16 phy_addr)
+ * @brief leave an ACTIVE page which another ACTIVE page replaces for a later
+ *  erase.
+ *
+ * Its last record slot is programmed first unless it is full already, so
+ * mount still sees it as replaced, see eeprom_is_replaced().
+ *
+ * @param phy_addr page physical address
+ *
+ * @return none
+ */
+static void eeprom_queue_erase(U16 phy_addr)
+{
+#if (EE_LAYOUT != EE_LAYOUT_SLOTS) && !EE_WIDE_RECORDS
+	if (flash_read_byte(phy_addr + EE_LOG_END - EE_VARIABLE_SIZE) == 0xFF)
+		flash_write_byte(phy_addr + EE_LOG_END - EE_VARIABLE_SIZE, 0x00);
+#endif
+	EE_SET_BITMAP(erase_map, (phy_addr - EE_BASE_ADDR) / EE_PAGE_SIZE);
+}
+
+/**
+ * @fn static U8 eeprom_erase_next(void)
+ * @brief erase the first queued page.
+ *
+ * @return TRUE: a page was erased; FALSE: no page is queued
+ */
+static U8 eeprom_erase_next(void)
+{
+	U8 i;
+	for (i = 0; i < EE_PAGES; i++) {
+		if (EE_GET_BITMAP(erase_map, i)) {
+			eeprom_format_page(EE_BASE_ADDR + i * EE_PAGE_SIZE);
+			EE_CLR_BITMAP(erase_map, i);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/**
+ * @fn static U8 eeprom_erase_pending(void)
+ * @brief count the queued pages.
+ *
+ * @return number of pages which wait for erase
+ */
+static U8 eeprom_erase_pending(void)
+{
+	U8 i, count = 0;
+	for (i = 0; i < EE_PAGES; i++) {
+		if (EE_GET_BITMAP(erase_map, i))
+			count++;
+	}
+	return count;
 }
+#endif
+
+#if !EE_RING_LOG
+/**
+ * @fn static void eeprom_retire_page(U16 phy_addr)
+ * @brief get rid of an ACTIVE page which another ACTIVE page replaces.
+ *
+ * With EE_DEFER_ERASE the page is only queued for eeprom_idle_erase(), see
+ * eeprom_queue_erase().
+ *
+ * @param phy_addr page physical address
+ *
+ * @return none
+ */
+static void eeprom_retire_page(U16 phy_addr)
+{
+#if EE_DEFER_ERASE
+	eeprom_queue_erase(phy_addr);
+#else
+	eeprom_format_page(phy_addr);
+#endif
+}
+#endif
 
 /**
  * @fn static void eeprom_update_page_info(U8 idx, U16 phy_addr, U16 tail)
@@ -126,187 +610,2361 @@ static void eeprom_update_page_info(U8 idx, U16 phy_addr, U16 tail)
 	page.tail = tail;
 }
 
+#if EE_LAYOUT == EE_LAYOUT_SLOTS
 /**
- * @fn static void eeprom_scan_page(U16 phy_addr, U8 idx)
- * @brief scan page and update page information
+ * @fn static U8 eeprom_slot_find(U16 phy_addr, EE_ADDR log_addr, U8 *byte)
+ * @brief find the latest value and the first erased slot of an address run
  *
- * @param phy_addr page physical address,
- * @param idx page index
+ * A value is never programmed as 0xFF, so the used slots of a run are always
+ * a prefix of it. Writing 0xFF programs the mark byte of the address with
+ * the number of used slots instead, the value is 0xFF until the next slot
+ * is used.
+ *
+ * @param phy_addr page physical address
+ * @param log_addr address in eeprom
+ * @param *byte pointer to latest value, 0xFF for an empty run
+ *
+ * @return number of used slots, EE_SLOTS_PER_ADDR for an exhausted run
  */
-static void eeprom_scan_page(U16 phy_addr, U8 idx)
+static U8 eeprom_slot_find(U16 phy_addr, EE_ADDR log_addr, U8 *byte)
 {
-	U16 tail;
-	for (tail = EE_TAG_SIZE; tail < FL_PAGE_SIZE; tail += EE_VARIABLE_SIZE) {
-		if( 0xFF == flash_read_byte(phy_addr + tail))
+	U8 i, dat;
+	U16 run = phy_addr + EE_SLOT_BASE + (U16)log_addr * EE_SLOTS_PER_ADDR;
+	*byte = 0xFF;
+	for (i = 0; i < EE_SLOTS_PER_ADDR; i++) {
+		dat = flash_read_byte(run + i);
+		if (0xFF == dat)
 			break;
+		*byte = dat;
 	}
-	eeprom_update_page_info(idx, phy_addr, tail);
+	if (flash_read_byte(phy_addr + EE_SLOT_MARKS + log_addr) == i)
+		*byte = 0xFF;
+	return i;
 }
 
 /**
- * @fn static void eeprom_check_pages(void)
- * @brief Check page status, handle different page status.
+ * @fn static U8 eeprom_slot_value(U16 phy_addr, EE_ADDR log_addr, U8 *byte)
+ * @brief find the latest value of an address run, see eeprom_slot_find()
  *
- *  The first byte of flash page is status byte. It contains three status:
- *  RECEIVING, ACTIVE, ERASED. We will format RECEIVING page; if ERASED page
- *  is not blank, we will format it too. If we have two more ACTIVE pages,
- *  we will erase full one
+ * @param phy_addr page physical address
+ * @param log_addr address in eeprom
+ * @param *byte pointer to latest value, 0xFF if there is none
  *
- * @return none
+ * @return TRUE: address holds a value; FALSE: it was never written
  */
-static void eeprom_check_pages(void)
+static U8 eeprom_slot_value(U16 phy_addr, EE_ADDR log_addr, U8 *byte)
 {
-    U8 i, status, idx, active_pages = 0;
-    U16 phy_addr ,active_page_addr = EE_BASE_ADDR;
-    for (i = 0; i < FL_PAGES; i++) {
-        phy_addr = EE_BASE_ADDR + i * FL_PAGE_SIZE;
-        status = flash_read_byte(phy_addr);
-        switch (status) {
-            case PAGE_STATUS_RECEIVING:
-            	eeprom_format_page(phy_addr);
-                break;
-            case PAGE_STATUS_ERASED:
-                if (!eeprom_is_formatted(phy_addr))
-                	eeprom_format_page(phy_addr);
-                break;
-            case PAGE_STATUS_ACTIVE:
-                if (active_pages++) {
-                    U16 tmp = phy_addr + FL_PAGE_SIZE - EE_VARIABLE_SIZE;
-                    /* erase a full contents page*/
-                    if (flash_read_byte(tmp) == 0xFF) {
-                    	eeprom_format_page(phy_addr);
-                    }else{
-                    	eeprom_format_page(active_page_addr);
-                    	active_page_addr = phy_addr;
-                    	idx = i;
-                    }
-                }else{
-                	active_page_addr = phy_addr;
-                	idx = i;
-                }
-                break;
-            default:
-                break;
-        }
-    }
-    /* If there is no active page, we update page status position with active status flag*/
-	if (0 == active_pages)
-		flash_write_byte(active_page_addr,PAGE_STATUS_ACTIVE);
-	eeprom_scan_page(active_page_addr,idx);
+	if (eeprom_slot_find(phy_addr, log_addr, byte))
+		return TRUE;
+	return (flash_read_byte(phy_addr + EE_SLOT_MARKS + log_addr) != 0xFF) ?
+	       TRUE : FALSE;
 }
+#endif
 
+#if EE_LAYOUT == EE_LAYOUT_SNAPSHOT
 /**
- * @fn static U16 eeprom_get_next_page(U8 page_idx)
- * @brief get next available page
- * 
- * @param page_idx page index number
+ * @fn static U8 eeprom_image_read(U16 phy_addr, EE_ADDR log_addr, U8 *byte)
+ * @brief read an address from snapshot image of a page
  *
- * @return Next available page address.
+ * A cleared bit in image presence bitmap means the image holds the address.
+ *
+ * @param phy_addr page physical address
+ * @param log_addr address in eeprom
+ * @param *byte pointer to byte data read from image
+ *
+ * @return TRUE: image holds the address; FALSE: not in image
  */
-static U16 eeprom_get_next_page(U8 page_idx)
+static U8 eeprom_image_read(U16 phy_addr, EE_ADDR log_addr, U8 *byte)
 {
-	U16 dest;
-	U8 idx = (page_idx + 1) % FL_PAGES;
-	dest =  EE_BASE_ADDR + idx * FL_PAGE_SIZE;
-	return dest;
+	if (flash_read_byte(phy_addr + EE_IMAGE_MAP + (log_addr >> 3))
+			& (1 << (log_addr % 8)))
+		return FALSE;
+	*byte = flash_read_byte(phy_addr + EE_IMAGE_DATA + log_addr);
+	return TRUE;
 }
+#endif
 
+#if (EE_LAYOUT != EE_LAYOUT_SLOTS) && !EE_SHADOW_ENABLE && !EE_BITMAP_ENABLE
 /**
- * @fn void flash_copy_page()
- * @brief move valid data from one page to another page.
+ * @fn static U16 eeprom_find_tail(U16 phy_addr)
+ * @brief find write pointer of a page by binary search over record slots.
  *
- * When an active page is full, it will find next available page, and write data
- * in it, and then call this function. It copies data from source page to
- * destination page.
+ * Records are strictly appended, so written and erased slots split the page
+ * in two. A blank address byte marks an erased slot. If the slots around
+ * the boundary found are not consistent, e.g. a torn record, fall back to
+ * the linear scan which stops at the first blank address byte.
  *
- * @note When calling this function, be aware that destination page already write
- * a pair of the data. Before copy loop start, we need to read it out and set
- * bitmap correspond bit to '1'.
+ * @param phy_addr page physical address
  *
- * @return none
+ * @return write pointer offset within the page
  */
-static void flash_copy_page()
+static U16 eeprom_find_tail(U16 phy_addr)
 {
-	U16 src, dest, tail;
-	U8 log_addr,idx;
-	U8 eeprom_bitmap[EE_BITMAP_SIZE];
-
-	for (idx = 0; idx < EE_BITMAP_SIZE; idx++) {
-        eeprom_bitmap[idx] = 0;
-    }
-	/* Source page scan start from bottom*/
-	src = page.addr + FL_PAGE_SIZE - EE_VARIABLE_SIZE;
+	U16 lo, hi, mid, tail;
 
-	dest = eeprom_get_next_page(page.idx);
-	/* Mark destination page as receiving status */
-	flash_write_byte(dest,PAGE_STATUS_RECEIVING);
-	EE_SET_BITMAP(flash_read_byte(dest + EE_TAG_SIZE));
-	tail =EE_TAG_SIZE + EE_VARIABLE_SIZE;
-	/* Read data from source page and copy it to destination page*/
-	while (src >= (page.addr + EE_TAG_SIZE)) {
-		log_addr = flash_read_byte(src);
-		if (log_addr < EE_SIZE) {
-			if (!EE_GET_BITMAP(log_addr)) {
-                flash_write_byte(dest + tail, log_addr);
-                flash_write_byte(dest + tail + 1, flash_read_byte(src + 1));
-				tail += EE_VARIABLE_SIZE;
-				EE_SET_BITMAP(log_addr);
-			}
-		}
-		src -= EE_VARIABLE_SIZE;
+	lo = 0;
+	hi = (EE_LOG_END - EE_LOG_START) / EE_VARIABLE_SIZE;
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		if (0xFF == flash_read_byte(phy_addr + EE_LOG_START + mid * EE_VARIABLE_SIZE))
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
+	tail = EE_LOG_START + lo * EE_VARIABLE_SIZE;
+	if (tail >= EE_LOG_END)
+		return tail;
+	/* First blank slot must be blank entirely and so must be the next one*/
+	if ((0xFF == flash_read_byte(phy_addr + tail + 1)) &&
+	    ((tail + EE_VARIABLE_SIZE >= EE_LOG_END) ||
+	     (0xFF == flash_read_byte(phy_addr + tail + EE_VARIABLE_SIZE))))
+		return tail;
+
+	return flash_find_fwd(phy_addr + EE_LOG_START, phy_addr + EE_LOG_END, 0xFF) -
+	       phy_addr;
+}
+
+#if EE_TX_ENABLE
+/**
+ * @fn static U16 eeprom_tx_cut(U16 phy_addr, U16 tail)
+ * @brief hide the records of a transaction which was not committed.
+ *
+ * Only the last transaction can lack its commit marker, so the begin record
+ * is searched among the last EE_TX_GROUP + 1 records only.
+ *
+ * @param phy_addr page physical address
+ * @param tail write pointer offset within the page
+ *
+ * @return offset of the open begin record, tail if there is none
+ */
+static U16 eeprom_tx_cut(U16 phy_addr, U16 tail)
+{
+	U16 lo, found;
+
+	lo = EE_LOG_START;
+	if (tail - EE_LOG_START > (EE_TX_GROUP + 1) * EE_VARIABLE_SIZE)
+		lo = tail - (EE_TX_GROUP + 1) * EE_VARIABLE_SIZE;
+	found = flash_find_back(phy_addr + tail - EE_VARIABLE_SIZE, phy_addr + lo,
+	                        (U8)EE_TX_BEGIN);
+	if (found && (0xFF == flash_read_byte(found + EE_DATA_OFFSET)))
+		return found - phy_addr;
+	return tail;
+}
+#endif
+#endif
+
+#if (EE_LAYOUT != EE_LAYOUT_SLOTS) && (!EE_SHADOW_ENABLE || !EE_BITMAP_ENABLE)
+/**
+ * @fn static U8 eeprom_find_value(EE_ADDR log_addr, U8 *byte)
+ * @brief look up the latest value of an address in active page.
+ *
+ * @param log_addr address in eeprom
+ * @param *byte pointer to latest value, 0xFF if there is none
+ *
+ * @return TRUE: address holds a value; FALSE: it was never written
+ */
+static U8 eeprom_find_value(EE_ADDR log_addr, U8 *byte)
+{
+	U16 phy_addr;
+
+	phy_addr = EE_FIND_RECORD(page.addr + page.tail - EE_VARIABLE_SIZE,
+	                          page.addr + EE_LOG_START, log_addr);
+	if (phy_addr) {
+		*byte = flash_read_byte(phy_addr + EE_DATA_OFFSET);
+		return TRUE;
+	}
+#if EE_LAYOUT == EE_LAYOUT_SNAPSHOT
+	if (eeprom_image_read(page.addr, log_addr, byte))
+		return TRUE;
+#endif
+	*byte = 0xFF;
+	return FALSE;
+}
+#endif
+
+#if EE_WRITE_ELIDE
+/**
+ * @fn static U8 eeprom_stored_value(EE_ADDR log_addr, U8 *byte)
+ * @brief value of an address as held in flash, for the write elide check.
+ *
+ * Unlike eeprom_read_byte() it skips the write-back buffer and reads the
+ * micro cache without reordering it or counting a hit or miss.
+ *
+ * @param log_addr address in eeprom
+ * @param *byte pointer to stored value, 0xFF if there is none
+ *
+ * @return TRUE: address holds a value; FALSE: it was never written
+ */
+static U8 eeprom_stored_value(EE_ADDR log_addr, U8 *byte)
+{
+#if EE_LRU_ENTRIES
+	U8 i;
+#endif
+#if EE_BITMAP_ENABLE
+	if (!EE_GET_BITMAP(ee_valid_map, log_addr)) {
+		*byte = 0xFF;
+		return FALSE;
+	}
+#endif
+#if EE_SHADOW_ENABLE && EE_BITMAP_ENABLE
+	*byte = ee_shadow[log_addr];
+	return TRUE;
+#else
+#if EE_SHADOW_ENABLE
+	/* Only an erased value needs the page to tell written from blank*/
+	*byte = ee_shadow[log_addr];
+	if (*byte != 0xFF)
+		return TRUE;
+#elif EE_LRU_ENTRIES
+	for (i = 0; i < EE_LRU_ENTRIES; i++) {
+		if ((lru_addr[i] == log_addr) &&
+		    (EE_BITMAP_ENABLE || (lru_data[i] != 0xFF))) {
+			*byte = lru_data[i];
+			return TRUE;
+		}
+	}
+#endif
+#if EE_LAYOUT == EE_LAYOUT_SLOTS
+	return eeprom_slot_value(page.addr, log_addr, byte);
+#else
+	return eeprom_find_value(log_addr, byte);
+#endif
+#endif
+}
+#endif
+
+#if EE_WIDE_RECORDS
+/**
+ * @fn static U16 eeprom_record_size(U16 phy_addr)
+ * @brief size of a record from its key, and length byte of a blob.
+ *
+ * A blob torn before its length byte was programmed only spans its head.
+ *
+ * @param phy_addr record physical address
+ *
+ * @return record size in bytes
+ */
+static U16 eeprom_record_size(U16 phy_addr)
+{
+	U8 key = flash_read_byte(phy_addr);
+#if EE_BLOBS
+	U8 len;
+	if ((EE_KEY_BLOB == key) || (EE_KEY_BLOB_OPEN == key)) {
+		len = flash_read_byte(phy_addr + 2);
+		return EE_BLOB_HEAD + ((0xFF == len) ? 0 : len);
+	}
+#endif
+	if (key < EE_KEY_U16)
+		return EE_VARIABLE_SIZE;
+	if (key < EE_KEY_U32)
+		return 3;
+	if (key < EE_KEY_PAD)
+		return 5;
+	if (key < EE_KEY_PAD + 8)
+		return 1 + (key & 0x07);
+	return EE_VARIABLE_SIZE;
+}
+
+/**
+ * @fn static U16 eeprom_skip_torn(U16 phy_addr, U16 tail)
+ * @brief step over the data of a record which was torn before its key was
+ *  programmed.
+ *
+ * Such data can only follow the write pointer directly. The blank key is
+ * programmed as a pad record covering it, in readonly mode the write
+ * pointer is left where it is.
+ *
+ * @param phy_addr page physical address
+ * @param tail write pointer offset within the page
+ *
+ * @return write pointer offset within the page
+ */
+static U16 eeprom_skip_torn(U16 phy_addr, U16 tail)
+{
+	U8 n;
+
+	if (flash_read_byte(phy_addr + tail) != 0xFF)
+		return tail;
+	for (n = 4; n; n--) {
+		if ((tail + n < EE_LOG_END) &&
+		    (flash_read_byte(phy_addr + tail + n) != 0xFF))
+			break;
+	}
+	if (!n || ee_readonly)
+		return tail;
+	flash_write_byte(phy_addr + tail, EE_KEY_PAD | n);
+	return tail + 1 + n;
+}
+#endif
+
+#if (EE_LAYOUT != EE_LAYOUT_SLOTS) && (EE_SHADOW_ENABLE || EE_BITMAP_ENABLE) && \
+	!EE_WIDE_RECORDS
+/**
+ * @fn static U16 eeprom_load_records(U16 phy_addr, U8 *map)
+ * @brief walk the record log of a page and load every record into the shadow
+ *  array and the valid address bitmap, later records overwrite earlier ones.
+ *
+ * With EE_RING_LOG a map can be given instead, the address of every record
+ * is then only marked in it.
+ *
+ * @param phy_addr page physical address
+ * @param *map bitmap of EE_BITMAP_SIZE bytes, 0 to load the records
+ *
+ * @return write pointer offset within the page
+ */
+static U16 eeprom_load_records(U16 phy_addr, U8 *map)
+{
+	U16 tail;
+	EE_ADDR log_addr;
+
+	for (tail = EE_LOG_START; tail < EE_LOG_END; tail += EE_VARIABLE_SIZE) {
+		log_addr = EE_READ_KEY(phy_addr + tail);
+		if (EE_ADDR_NONE == log_addr)
+			break;
+#if EE_TX_ENABLE
+		/* Open transaction can only be the last one*/
+		if ((EE_TX_BEGIN == log_addr) &&
+		    (0xFF == flash_read_byte(phy_addr + tail + EE_DATA_OFFSET)))
+			break;
+#endif
+		if (log_addr < EE_SIZE) {
+#if EE_RING_LOG
+			if (map) {
+				EE_SET_BITMAP(map, log_addr);
+				continue;
+			}
+#endif
+#if EE_SHADOW_ENABLE
+			ee_shadow[log_addr] = flash_read_byte(phy_addr + tail + EE_DATA_OFFSET);
+#endif
+#if EE_BITMAP_ENABLE
+			EE_SET_BITMAP(ee_valid_map, log_addr);
+#endif
+		}
+	}
+	return tail;
+}
+#endif
+
+/**
+ * @fn static void eeprom_scan_page(U16 phy_addr, U8 idx)
+ * @brief scan page and update page information
+ *
+ * The same pass loads every record into the shadow array and the valid
+ * address bitmap when they are enabled, later records overwrite earlier ones.
+ * In snapshot layout the image is loaded before the record log. In slots
+ * layout there is no record log, only the address runs are loaded. Without
+ * any of them the write pointer is found by eeprom_find_tail().
+ *
+ * With EE_TX_ENABLE the write pointer stops at the begin record of a
+ * transaction which was not committed, eeprom_init() drops the records past
+ * it.
+ *
+ * With EE_RING_LOG the older pages of the ring are loaded first, oldest
+ * one first, and the page given is the newest one.
+ *
+ * @param phy_addr page physical address,
+ * @param idx page index
+ */
+static void eeprom_scan_page(U16 phy_addr, U8 idx)
+{
+	U16 tail;
+#if EE_SHADOW_ENABLE || EE_BITMAP_ENABLE
+	EE_ADDR log_addr;
+#endif
+#if EE_WIDE_RECORDS
+	U16 size;
+#endif
+#if EE_WIDE_RECORDS || EE_RING_LOG
+	U8 i;
+#endif
+#if (EE_LAYOUT != EE_LAYOUT_LOG) && (EE_SHADOW_ENABLE || EE_BITMAP_ENABLE)
+	U8 byte;
+#endif
+
+#if EE_SHADOW_ENABLE
+	for (log_addr = 0; log_addr < EE_SIZE; log_addr++) {
+		ee_shadow[log_addr] = 0xFF;
+	}
+#endif
+#if EE_BITMAP_ENABLE
+	for (log_addr = 0; log_addr < EE_BITMAP_SIZE; log_addr++) {
+		ee_valid_map[log_addr] = 0;
+	}
+#endif
+#if (EE_LAYOUT != EE_LAYOUT_LOG) && (EE_SHADOW_ENABLE || EE_BITMAP_ENABLE)
+	/* Load snapshot image or address runs first, the record log overrides it*/
+	for (log_addr = 0; log_addr < EE_SIZE; log_addr++) {
+#if EE_LAYOUT == EE_LAYOUT_SLOTS
+		if (eeprom_slot_value(phy_addr, log_addr, &byte)) {
+#else
+		if (eeprom_image_read(phy_addr, log_addr, &byte)) {
+#endif
+#if EE_SHADOW_ENABLE
+			ee_shadow[log_addr] = byte;
+#endif
+#if EE_BITMAP_ENABLE
+			EE_SET_BITMAP(ee_valid_map, log_addr);
+#endif
+		}
+	}
+#endif
+#if EE_LAYOUT == EE_LAYOUT_SLOTS
+	tail = EE_SLOT_BASE;
+#elif !EE_SHADOW_ENABLE && !EE_BITMAP_ENABLE
+	tail = eeprom_find_tail(phy_addr);
+#if EE_TX_ENABLE
+	tail = eeprom_tx_cut(phy_addr, tail);
+#endif
+#elif EE_WIDE_RECORDS
+#if EE_BLOBS
+	for (i = 0; i < EE_BLOBS; i++) {
+		blob_pos[i] = 0;
+	}
+#endif
+	for (tail = EE_LOG_START; tail < EE_LOG_END; tail += size) {
+		log_addr = flash_read_byte(phy_addr + tail);
+		if (0xFF == log_addr)
+			break;
+#if EE_TX_ENABLE
+		/* Open transaction can only be the last one*/
+		if ((EE_TX_BEGIN == log_addr) &&
+		    (0xFF == flash_read_byte(phy_addr + tail + 1)))
+			break;
+#endif
+		size = eeprom_record_size(phy_addr + tail);
+#if EE_BLOBS
+		if (EE_KEY_BLOB == log_addr) {
+			i = flash_read_byte(phy_addr + tail + 1);
+			if (i < EE_BLOBS)
+				blob_pos[i] = tail;
+		}
+#endif
+		/* Data bytes go to consecutive addresses from the key, a record
+		 * which runs past EE_SIZE is garbage and skipped*/
+		if ((log_addr < EE_KEY_PAD) &&
+		    ((log_addr & 0x3F) + size - 1 <= EE_SIZE)) {
+			for (i = 1; i < size; i++) {
+				ee_shadow[(log_addr & 0x3F) + i - 1] =
+					flash_read_byte(phy_addr + tail + i);
+				EE_SET_BITMAP(ee_valid_map, (log_addr & 0x3F) + i - 1);
+			}
+		}
+	}
+	if (tail < EE_LOG_END)
+		tail = eeprom_skip_torn(phy_addr, tail);
+#else
+#if EE_RING_LOG
+	/* Older pages of the ring first, the newest page gives the write pointer*/
+	for (i = ring_old; i != idx; i = (i + 1) % EE_PAGES) {
+		if (flash_read_byte(EE_BASE_ADDR + i * EE_PAGE_SIZE) == PAGE_STATUS_ACTIVE)
+			eeprom_load_records(EE_BASE_ADDR + i * EE_PAGE_SIZE, 0);
+	}
+#endif
+	tail = eeprom_load_records(phy_addr, 0);
+#endif
+#if EE_LRU_ENTRIES
+	eeprom_lru_reset();
+#endif
+	eeprom_update_page_info(idx, phy_addr, tail);
+}
+
+#if !EE_RING_LOG
+/**
+ * @fn static U8 eeprom_is_replaced(U16 phy_addr)
+ * @brief Check whether an ACTIVE page is the source of a compaction which
+ *  was interrupted before the source page was erased.
+ *
+ * Compaction only starts from a full page (log and snapshot layout) or a
+ * sealed page (slots layout), the destination page never is.
+ *
+ * @param phy_addr page physical address
+ * @return TRUE: page is replaced by another ACTIVE page; FALSE: it is not
+ */
+static U8 eeprom_is_replaced(U16 phy_addr)
+{
+#if EE_LAYOUT == EE_LAYOUT_SLOTS
+	return (flash_read_byte(phy_addr + EE_SLOT_SEAL) != 0xFF) ? TRUE : FALSE;
+#elif EE_WIDE_RECORDS
+	return (flash_read_byte(phy_addr + EE_LOG_SEAL) != 0xFF) ? TRUE : FALSE;
+#else
+	return (flash_read_byte(phy_addr + EE_LOG_END - EE_VARIABLE_SIZE) != 0xFF) ?
+	       TRUE : FALSE;
+#endif
+}
+#endif
+
+/**
+ * @fn static U8 eeprom_check_pages(U8 readonly)
+ * @brief Check page status, handle different page status.
+ *
+ *  The first byte of flash page is status byte. It contains three status:
+ *  RECEIVING, ACTIVE, ERASED. We will format RECEIVING page; if ERASED page
+ *  is not blank, we will format it too. If we have two more ACTIVE pages,
+ *  we will erase the replaced one, see eeprom_is_replaced().
+ *
+ *  In readonly mode nothing is programmed or erased, the page which would be
+ *  kept is selected and the others are ignored.
+ *
+ *  Every page here is a virtual page of EE_VPAGE_PAGES flash pages, its
+ *  status byte and tag are in the first one.
+ *
+ *  With EE_RING_LOG every ACTIVE page belongs to the ring, the sequence
+ *  numbers tell the newest and the oldest one. The ring never takes the
+ *  last spare page for long: if no page is spare, a reset came right after
+ *  the values of the oldest page were carried forward, it is erased.
+ *
+ * @param readonly TRUE: never touch flash; FALSE: repair pages
+ *
+ * @return 0: success; 1: error, no page holds consistent data
+ */
+static U8 eeprom_check_pages(U8 readonly)
+{
+    U8 i, status, idx = 0, active_pages = 0;
+    U16 phy_addr ,active_page_addr = EE_BASE_ADDR;
+#if EE_RING_LOG
+    U16 seq, new_seq = 0, old_seq = 0;
+#endif
+    for (i = 0; i < EE_PAGES; i++) {
+        phy_addr = EE_BASE_ADDR + i * EE_PAGE_SIZE;
+#if EE_WEAR_LEVEL
+        wear_count[i] = eeprom_erase_count(phy_addr);
+#endif
+        status = flash_read_byte(phy_addr);
+        switch (status) {
+            case PAGE_STATUS_RECEIVING:
+                if (!readonly)
+                	eeprom_format_page(phy_addr);
+                break;
+            case PAGE_STATUS_ERASED:
+#if !EE_FAST_MOUNT
+                if (!readonly && !eeprom_is_formatted(phy_addr))
+                	eeprom_format_page(phy_addr);
+#endif
+                break;
+            case PAGE_STATUS_ACTIVE:
+#if EE_RING_LOG
+                seq = eeprom_ring_seq(phy_addr);
+                if (!active_pages || ((S16)(seq - new_seq) > 0)) {
+                	new_seq = seq;
+                	active_page_addr = phy_addr;
+                	idx = i;
+                }
+                if (!active_pages || ((S16)(seq - old_seq) < 0)) {
+                	old_seq = seq;
+                	ring_old = i;
+                }
+                active_pages++;
+#else
+                if (active_pages++) {
+                    if (eeprom_is_replaced(phy_addr)) {
+                    	if (!readonly)
+                    		eeprom_retire_page(phy_addr);
+                    }else{
+                    	if (!readonly)
+                    		eeprom_retire_page(active_page_addr);
+                    	active_page_addr = phy_addr;
+                    	idx = i;
+                    }
+                }else{
+                	active_page_addr = phy_addr;
+                	idx = i;
+                }
+#endif
+                break;
+            default:
+                break;
+        }
+    }
+	if (0 == active_pages) {
+		if (readonly) {
+			/* Any blank page gives an empty eeprom, e.g. a virgin device*/
+			for (idx = 0; idx < EE_PAGES; idx++) {
+				active_page_addr = EE_BASE_ADDR + idx * EE_PAGE_SIZE;
+				if ((flash_read_byte(active_page_addr) == PAGE_STATUS_ERASED) &&
+				    eeprom_is_blank(active_page_addr))
+					break;
+			}
+			if (idx == EE_PAGES)
+				return ERROR;
+		} else {
+			/* If there is no active page, we update page status position with active status flag*/
+			eeprom_check_spare(active_page_addr);
+			flash_write_byte(active_page_addr,PAGE_STATUS_ACTIVE);
+		}
+#if EE_RING_LOG
+		ring_old = idx;
+#endif
+	}
+#if EE_RING_LOG
+	if ((EE_PAGES == active_pages) && !readonly) {
+		eeprom_format_page(EE_BASE_ADDR + ring_old * EE_PAGE_SIZE);
+		ring_old = (ring_old + 1) % EE_PAGES;
+	}
+#endif
+	eeprom_scan_page(active_page_addr,idx);
+	return SUCCESS;
+}
+
+/**
+ * @fn static U16 eeprom_get_next_page(U8 page_idx)
+ * @brief get next available page
+ *
+ * With EE_WEAR_LEVEL it is the least worn page other than page_idx, pages
+ * are compared in turn from the next one so a tie keeps the rotation.
+ * 
+ * @param page_idx page index number
+ *
+ * @return Next available page address.
+ */
+static U16 eeprom_get_next_page(U8 page_idx)
+{
+	U16 dest;
+	U8 idx = (page_idx + 1) % EE_PAGES;
+#if EE_WEAR_LEVEL
+	U8 i, cand;
+	for (i = 2; i < EE_PAGES; i++) {
+		cand = (page_idx + i) % EE_PAGES;
+		if (wear_count[cand] < wear_count[idx])
+			idx = cand;
+	}
+#endif
+	dest =  EE_BASE_ADDR + idx * EE_PAGE_SIZE;
+	return dest;
+}
+
+#if EE_COUNTERS
+/**
+ * @fn static U8 eeprom_counter_find(U16 field)
+ * @brief find first byte of a counter bitfield which still has a set bit.
+ *
+ * Bits are cleared from byte 0 upwards and from bit 0 upwards within a byte,
+ * so the bitfield reads as 0x00 bytes, at most one partial byte and 0xFF
+ * bytes. A binary search finds the boundary.
+ *
+ * @param field bitfield physical address
+ *
+ * @return byte index, EE_COUNTER_BYTES if the bitfield is full
+ */
+static U8 eeprom_counter_find(U16 field)
+{
+	U8 lo, hi, mid;
+
+	lo = 0;
+	hi = EE_COUNTER_BYTES;
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		if (flash_read_byte(field + mid))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/**
+ * @fn static U32 eeprom_counter_value(U16 phy_addr, U8 id)
+ * @brief read a counter of a page, base plus cleared bits.
+ *
+ * @param phy_addr page physical address
+ * @param id counter number
+ *
+ * @return counter value
+ */
+static U32 eeprom_counter_value(U16 phy_addr, U8 id)
+{
+	U32 value;
+	U8 i, byte;
+
+	phy_addr += EE_COUNTER_AREA + (U16)id * EE_COUNTER_SIZE;
+	/* Base is stored inverted MSB first, so a blank page counts from 0*/
+	value = 0;
+	for (i = 0; i < 4; i++) {
+		value = (value << 8) | (U8)~flash_read_byte(phy_addr + i);
+	}
+	phy_addr += 4;
+	i = eeprom_counter_find(phy_addr);
+	value += (U32)i * 8;
+	if (i < EE_COUNTER_BYTES) {
+		/* Partial byte is 0xFF shifted left by the number of cleared bits*/
+		for (byte = flash_read_byte(phy_addr + i); !(byte & 1); byte >>= 1) {
+			value++;
+		}
+	}
+	return value;
+}
+
+/**
+ * @fn static void eeprom_counter_copy(U16 dest)
+ * @brief fold every counter of active page into the base of destination
+ *  page, its bitfields stay blank.
+ *
+ * @param dest destination page physical address
+ *
+ * @return none
+ */
+static void eeprom_counter_copy(U16 dest)
+{
+	U32 value;
+	U8 id, i;
+
+	for (id = 0; id < EE_COUNTERS; id++) {
+		value = ~eeprom_counter_value(page.addr, id);
+		for (i = 0; i < 4; i++) {
+			if ((U8)(value >> 24) != 0xFF)
+				flash_write_byte(dest + EE_COUNTER_AREA +
+				                 (U16)id * EE_COUNTER_SIZE + i, (U8)(value >> 24));
+			value <<= 8;
+		}
+	}
+}
+#endif
+
+#if EE_LAYOUT != EE_LAYOUT_SLOTS
+#if EE_SHADOW_ENABLE && EE_BITMAP_ENABLE && !EE_WIDE_RECORDS
+/**
+ * @fn static U8 eeprom_copy_verify(U16 dest, U16 from, U8 *skip_map)
+ * @brief read back a page built from RAM before it is activated.
+ *
+ * Every written address not in skip_map must hold its shadow value: in log
+ * layout as records in address order from offset 'from', in snapshot
+ * layout in the image, whose presence bitmap is checked as well.
+ *
+ * @param dest destination page physical address
+ * @param from offset of the first record built from RAM
+ * @param *skip_map bitmap of the addresses which were not built from RAM
+ *
+ * @return 0: page holds every value; 1: error, a byte reads back wrong
+ */
+static U8 eeprom_copy_verify(U16 dest, U16 from, U8 *skip_map)
+{
+	EE_ADDR log_addr;
+
+#if EE_LAYOUT == EE_LAYOUT_SNAPSHOT
+	for (log_addr = 0; log_addr < EE_BITMAP_SIZE; log_addr++) {
+		if (flash_read_byte(dest + EE_IMAGE_MAP + log_addr) !=
+		    (U8)~(skip_map[log_addr] | ee_valid_map[log_addr]))
+			return ERROR;
+	}
+#endif
+	for (log_addr = 0; log_addr < EE_SIZE; log_addr++) {
+		if (!EE_GET_BITMAP(ee_valid_map, log_addr) ||
+		    EE_GET_BITMAP(skip_map, log_addr))
+			continue;
+#if EE_LAYOUT == EE_LAYOUT_SNAPSHOT
+		if (flash_read_byte(dest + EE_IMAGE_DATA + log_addr) != ee_shadow[log_addr])
+			return ERROR;
+#else
+		if ((EE_READ_KEY(dest + from) != log_addr) ||
+		    (flash_read_byte(dest + from + EE_DATA_OFFSET) != ee_shadow[log_addr]))
+			return ERROR;
+		from += EE_VARIABLE_SIZE;
+#endif
+	}
+	return SUCCESS;
+}
+#endif
+
+#if EE_RING_LOG
+/**
+ * @fn static U8 eeprom_ring_advance(void)
+ * @brief move the write pointer of the ring log to the next page.
+ *
+ * The next page gets the next sequence number and becomes the newest page.
+ * If it is the last spare page, every value which no newer page holds is
+ * carried forward from the oldest page first, then the oldest page is
+ * erased. The sequence number is programmed before the status byte, a reset
+ * in between leaves a page which is not formatted. Carried values are read
+ * back before the page is activated.
+ *
+ * @return 0: success; 1: error, carried values read back wrong and the ring
+ *  is left as it was
+ */
+static U8 eeprom_ring_advance(void)
+{
+	U16 dest, seq, tail;
+	EE_ADDR log_addr;
+	U8 i;
+
+	dest = eeprom_get_next_page(page.idx);
+	eeprom_check_spare(dest);
+	seq = eeprom_ring_seq(page.addr) + 1;
+	flash_write_byte(dest + EE_SEQ_OFFSET, (U8)(seq >> 8));
+	flash_write_byte(dest + EE_SEQ_OFFSET + 1, (U8)seq);
+#if EE_COUNTERS
+	eeprom_counter_copy(dest);
+#endif
+	tail = EE_LOG_START;
+	if ((page.idx + 2) % EE_PAGES == ring_old) {
+		/* Mark destination page as receiving status */
+		flash_write_byte(dest, PAGE_STATUS_RECEIVING);
+		for (log_addr = 0; log_addr < EE_BITMAP_SIZE; log_addr++) {
+			ee_scratch_map[log_addr] = 0;
+		}
+		for (i = ring_old; i != page.idx; ) {
+			i = (i + 1) % EE_PAGES;
+			eeprom_load_records(EE_BASE_ADDR + i * EE_PAGE_SIZE, ee_scratch_map);
+		}
+		/* Latest record of such an address is in the oldest page, shadow
+		 * array holds its value*/
+		for (log_addr = 0; log_addr < EE_SIZE; log_addr++) {
+			if (EE_GET_BITMAP(ee_valid_map, log_addr) &&
+			    !EE_GET_BITMAP(ee_scratch_map, log_addr)) {
+				EE_WRITE_KEY(dest + tail, log_addr);
+				flash_write_byte(dest + tail + EE_DATA_OFFSET, ee_shadow[log_addr]);
+				tail += EE_VARIABLE_SIZE;
+			}
+		}
+		if (eeprom_copy_verify(dest, EE_LOG_START, ee_scratch_map)) {
+			eeprom_format_page(dest);
+			return ERROR;
+		}
+		flash_write_byte(dest, PAGE_STATUS_ACTIVE);
+		eeprom_format_page(EE_BASE_ADDR + ring_old * EE_PAGE_SIZE);
+		ring_old = (ring_old + 1) % EE_PAGES;
+	} else {
+		flash_write_byte(dest, PAGE_STATUS_ACTIVE);
+	}
+	i = (dest - EE_BASE_ADDR) / EE_PAGE_SIZE;
+	eeprom_update_page_info(i, dest, tail);
+	return SUCCESS;
+}
+#else
+/**
+ * @fn static U8 flash_copy_page(U16 dest, U8 pending)
+ * @brief move valid data from one page to another page.
+ *
+ * When an active page is full, it will find next available page, and write data
+ * in it, and then call this function. It copies data from source page to
+ * destination page. In snapshot layout every live value goes to the image of
+ * destination page instead of a new record.
+ *
+ * With EE_SHADOW_ENABLE and EE_BITMAP_ENABLE the source page is not scanned,
+ * live values are written from RAM in address order and read back before
+ * the destination page is activated. Otherwise, and with EE_WIDE_RECORDS,
+ * each byte is read back as it is programmed. If a byte reads back wrong,
+ * the destination page is formatted and the source page stays active.
+ *
+ * @note When calling this function with pending set, be aware that destination
+ * page already write a pair of the data. Before copy loop start, we need to
+ * read it out and set bitmap correspond bit to '1'.
+ *
+ * @param dest destination page physical address, see eeprom_get_next_page()
+ * @param pending TRUE: destination page holds the record being written
+ *
+ * @return 0: success; 1: error, destination page reads back wrong
+ */
+static U8 flash_copy_page(U16 dest, U8 pending)
+{
+	U16 tail;
+	EE_ADDR log_addr, idx;
+#if !EE_SHADOW_ENABLE || !EE_BITMAP_ENABLE || EE_BLOBS
+	U16 src;
+#endif
+#if (EE_LAYOUT == EE_LAYOUT_SNAPSHOT) && (!EE_SHADOW_ENABLE || !EE_BITMAP_ENABLE)
+	U8 byte;
+#endif
+#if EE_WIDE_RECORDS
+	U8 size, key;
+#endif
+#if EE_BLOBS
+	U16 blob_tail;
+#endif
+#if !EE_SHADOW_ENABLE || !EE_BITMAP_ENABLE || EE_WIDE_RECORDS
+	U8 bad = FALSE;
+#endif
+
+	for (idx = 0; idx < EE_BITMAP_SIZE; idx++) {
+        ee_scratch_map[idx] = 0;
+    }
+#if !EE_SHADOW_ENABLE || !EE_BITMAP_ENABLE
+	/* Source page scan start from bottom*/
+	src = page.addr + page.tail - EE_VARIABLE_SIZE;
+#endif
+
+#if EE_WIDE_RECORDS
+#if EE_DEFER_ERASE
+	/* No stale sealed page may stay while the source is sealed*/
+	while (eeprom_idle_erase())
+		;
+#endif
+	/* Source page need not be full, seal it for eeprom_is_replaced()*/
+	if (flash_read_byte(page.addr + EE_LOG_SEAL) == 0xFF)
+		flash_write_byte(page.addr + EE_LOG_SEAL, 0x00);
+#endif
+	/* Mark destination page as receiving status */
+	flash_write_byte(dest,PAGE_STATUS_RECEIVING);
+#if EE_COUNTERS
+	eeprom_counter_copy(dest);
+#endif
+	tail = EE_LOG_START;
+	if (pending) {
+		tail += EE_VARIABLE_SIZE;
+		log_addr = EE_READ_KEY(dest + EE_LOG_START);
+#if EE_LAYOUT == EE_LAYOUT_SNAPSHOT
+		/* Newest value first, the record log copy wins over source image*/
+		flash_write_byte(dest + EE_IMAGE_DATA + log_addr,
+		                 flash_read_byte(dest + EE_LOG_START + EE_DATA_OFFSET));
+#endif
+		EE_SET_BITMAP(ee_scratch_map, log_addr);
+	}
+#if EE_SHADOW_ENABLE && EE_BITMAP_ENABLE && !EE_WIDE_RECORDS
+	/* Live values come from RAM in address order, the record being written
+	 * is newer than its shadow value*/
+	for (log_addr = 0; log_addr < EE_SIZE; log_addr++) {
+		if (!EE_GET_BITMAP(ee_valid_map, log_addr) ||
+		    EE_GET_BITMAP(ee_scratch_map, log_addr))
+			continue;
+#if EE_LAYOUT == EE_LAYOUT_SNAPSHOT
+		flash_write_byte(dest + EE_IMAGE_DATA + log_addr, ee_shadow[log_addr]);
+#else
+		EE_WRITE_KEY(dest + tail, log_addr);
+		flash_write_byte(dest + tail + EE_DATA_OFFSET, ee_shadow[log_addr]);
+		tail += EE_VARIABLE_SIZE;
+#endif
+	}
+#if EE_LAYOUT == EE_LAYOUT_SNAPSHOT
+	for (idx = 0; idx < EE_BITMAP_SIZE; idx++) {
+		flash_write_byte(dest + EE_IMAGE_MAP + idx, ~(ee_scratch_map[idx] | ee_valid_map[idx]));
+	}
+#endif
+	/* Read back before the source page is given up*/
+	if (eeprom_copy_verify(dest, pending ? EE_LOG_START + EE_VARIABLE_SIZE :
+	                       EE_LOG_START, ee_scratch_map)) {
+		eeprom_format_page(dest);
+		return ERROR;
+	}
+#elif EE_LAYOUT == EE_LAYOUT_SNAPSHOT
+	while (src >= (page.addr + EE_LOG_START)) {
+		log_addr = EE_READ_KEY(src);
+		if (log_addr < EE_SIZE) {
+			if (!EE_GET_BITMAP(ee_scratch_map, log_addr)) {
+				byte = flash_read_byte(src + EE_DATA_OFFSET);
+				flash_write_byte(dest + EE_IMAGE_DATA + log_addr, byte);
+				if (flash_read_byte(dest + EE_IMAGE_DATA + log_addr) != byte)
+					bad = TRUE;
+				EE_SET_BITMAP(ee_scratch_map, log_addr);
+			}
+		}
+		src -= EE_VARIABLE_SIZE;
+	}
+	for (log_addr = 0; log_addr < EE_SIZE; log_addr++) {
+		if (!EE_GET_BITMAP(ee_scratch_map, log_addr) &&
+		    eeprom_image_read(page.addr, log_addr, &byte)) {
+			flash_write_byte(dest + EE_IMAGE_DATA + log_addr, byte);
+			if (flash_read_byte(dest + EE_IMAGE_DATA + log_addr) != byte)
+				bad = TRUE;
+			EE_SET_BITMAP(ee_scratch_map, log_addr);
+		}
+	}
+	/* Presence bitmap is written once per byte, cleared bit means present*/
+	for (idx = 0; idx < EE_BITMAP_SIZE; idx++) {
+		flash_write_byte(dest + EE_IMAGE_MAP + idx, ~ee_scratch_map[idx]);
+		if ((flash_read_byte(dest + EE_IMAGE_MAP + idx) ^ ee_scratch_map[idx]) != 0xFF)
+			bad = TRUE;
+	}
+#elif EE_WIDE_RECORDS
+	/* Record sizes vary, copy from RAM and pack runs of written addresses*/
+	for (log_addr = 0; log_addr < EE_SIZE; log_addr += size) {
+		for (size = 0; (size < 4) && (log_addr + size < EE_SIZE); size++) {
+			if (!EE_GET_BITMAP(ee_valid_map, log_addr + size) ||
+			    EE_GET_BITMAP(ee_scratch_map, log_addr + size))
+				break;
+		}
+		if (0 == size) {
+			size = 1;
+			continue;
+		}
+		if (3 == size)
+			size = 2;
+		key = (4 == size) ? (EE_KEY_U32 | log_addr) :
+		      (2 == size) ? (EE_KEY_U16 | log_addr) : log_addr;
+		flash_write_byte(dest + tail, key);
+		for (idx = 0; idx < size; idx++) {
+			flash_write_byte(dest + tail + 1 + idx, ee_shadow[log_addr + idx]);
+		}
+		if (flash_read_byte(dest + tail) != key)
+			bad = TRUE;
+		for (idx = 0; idx < size; idx++) {
+			if (flash_read_byte(dest + tail + 1 + idx) != ee_shadow[log_addr + idx])
+				bad = TRUE;
+		}
+		tail += 1 + size;
+	}
+#if EE_BLOBS
+	/* Latest record of every blob moves as one unit, committed already.
+	 * blob_pos[] keeps the source offsets until the page reads back right*/
+	blob_tail = tail;
+	for (idx = 0; idx < EE_BLOBS; idx++) {
+		if (!blob_pos[idx])
+			continue;
+		src = page.addr + blob_pos[idx];
+		size = EE_BLOB_HEAD + flash_read_byte(src + 2);
+		for (log_addr = 0; log_addr < size; log_addr++) {
+			flash_write_byte(dest + tail + log_addr, flash_read_byte(src + log_addr));
+			if (flash_read_byte(dest + tail + log_addr) != flash_read_byte(src + log_addr))
+				bad = TRUE;
+		}
+		tail += size;
+	}
+#endif
+#else
+	/* Read data from source page and copy it to destination page*/
+	while (src >= (page.addr + EE_LOG_START)) {
+		log_addr = EE_READ_KEY(src);
+		if (log_addr < EE_SIZE) {
+			if (!EE_GET_BITMAP(ee_scratch_map, log_addr)) {
+                EE_WRITE_KEY(dest + tail, log_addr);
+                flash_write_byte(dest + tail + EE_DATA_OFFSET,
+                                 flash_read_byte(src + EE_DATA_OFFSET));
+				if ((EE_READ_KEY(dest + tail) != log_addr) ||
+				    (flash_read_byte(dest + tail + EE_DATA_OFFSET) !=
+				     flash_read_byte(src + EE_DATA_OFFSET)))
+					bad = TRUE;
+				tail += EE_VARIABLE_SIZE;
+				EE_SET_BITMAP(ee_scratch_map, log_addr);
+			}
+		}
+		src -= EE_VARIABLE_SIZE;
+	}
+#endif
+#if !EE_SHADOW_ENABLE || !EE_BITMAP_ENABLE || EE_WIDE_RECORDS
+	/* Every byte was read back as it was programmed*/
+	if (bad) {
+		eeprom_format_page(dest);
+		return ERROR;
+	}
+#endif
+#if EE_BLOBS
+	for (idx = 0; idx < EE_BLOBS; idx++) {
+		if (!blob_pos[idx])
+			continue;
+		size = EE_BLOB_HEAD + flash_read_byte(page.addr + blob_pos[idx] + 2);
+		blob_pos[idx] = blob_tail;
+		blob_tail += size;
+	}
+#endif
     /* Mark destination page as active status*/
 	flash_write_byte(dest,PAGE_STATUS_ACTIVE);
-	/* Erase source page and update erase count in page TAG position*/
-	eeprom_format_page(page.addr);
+	/* Erase source page and update erase count in page TAG position, or
+	 * leave it to eeprom_idle_erase()*/
+	eeprom_retire_page(page.addr);
 	/* Update page information*/
-	idx = (dest - EE_BASE_ADDR) / FL_PAGE_SIZE;
+	idx = (dest - EE_BASE_ADDR) / EE_PAGE_SIZE;
 	eeprom_update_page_info(idx, dest, tail);
+	return SUCCESS;
+}
+#endif
+
+#if EE_GC_RESERVE
+/**
+ * @fn static U8 eeprom_gc_step(void)
+ * @brief run one step of the incremental compaction.
+ *
+ * The first step marks the next page RECEIVING, every further step copies
+ * the value of one address and the last one activates the page the way
+ * flash_copy_page() does. The old page is only queued, its erase is a step
+ * of eeprom_maintenance() of its own. Values written meanwhile still go to
+ * the active page, see eeprom_cache_update(). A reset leaves a RECEIVING
+ * page which mount formats, the active page keeps every value.
+ *
+ * Every copied value is read back in the step which programs it, so the
+ * page is verified by the time it is activated without a step which reads
+ * the whole page. A wrong byte gives the compaction up, its page is queued
+ * for erase and the active page stays.
+ *
+ * @return 0: success; 1: error, a value read back wrong
+ */
+static U8 eeprom_gc_step(void)
+{
+	U8 written, byte, idx;
+
+	if (!gc_dest) {
+		gc_dest = eeprom_get_next_page(page.idx);
+		eeprom_check_spare(gc_dest);
+		flash_write_byte(gc_dest, PAGE_STATUS_RECEIVING);
+		gc_tail = EE_LOG_START;
+		gc_next = 0;
+		return SUCCESS;
+	}
+	if (gc_next < EE_SIZE) {
+#if EE_SHADOW_ENABLE && EE_BITMAP_ENABLE
+		written = EE_GET_BITMAP(ee_valid_map, gc_next) ? TRUE : FALSE;
+		byte = ee_shadow[gc_next];
+#elif EE_BITMAP_ENABLE
+		written = EE_GET_BITMAP(ee_valid_map, gc_next) ?
+		          eeprom_find_value(gc_next, &byte) : FALSE;
+#else
+		written = eeprom_find_value(gc_next, &byte);
+#endif
+		if (written) {
+#if EE_LAYOUT == EE_LAYOUT_SNAPSHOT
+			flash_write_byte(gc_dest + EE_IMAGE_DATA + gc_next, byte);
+			/* Presence bits are cleared one at a time*/
+			flash_write_byte(gc_dest + EE_IMAGE_MAP + (gc_next >> 3),
+			                 ~(1 << (gc_next % 8)));
+			if ((flash_read_byte(gc_dest + EE_IMAGE_DATA + gc_next) != byte) ||
+			    (flash_read_byte(gc_dest + EE_IMAGE_MAP + (gc_next >> 3)) &
+			     (1 << (gc_next % 8)))) {
+				eeprom_gc_abort();
+				return ERROR;
+			}
+#else
+			if (eeprom_gc_put(gc_next, byte))
+				return ERROR;
+#endif
+		}
+		gc_next++;
+		return SUCCESS;
+	}
+#if EE_COUNTERS
+	eeprom_counter_copy(gc_dest);
+#endif
+	flash_write_byte(gc_dest, PAGE_STATUS_ACTIVE);
+	eeprom_queue_erase(page.addr);
+	idx = (gc_dest - EE_BASE_ADDR) / EE_PAGE_SIZE;
+	eeprom_update_page_info(idx, gc_dest, gc_tail);
+	gc_dest = 0;
+	return SUCCESS;
+}
+#endif
+
+/**
+ * @fn static U8 eeprom_compact(void)
+ * @brief compact the active page now. A running incremental compaction is
+ *  finished instead of starting over. The ring log moves on to its next
+ *  page instead.
+ *
+ * @return 0: success; 1: error, see flash_copy_page() and eeprom_gc_step()
+ */
+static U8 eeprom_compact(void)
+{
+#if !EE_RING_LOG
+	U16 dest;
+#endif
+#if EE_GC_RESERVE
+	if (gc_dest) {
+		while (gc_dest) {
+			if (eeprom_gc_step())
+				return ERROR;
+		}
+		return SUCCESS;
+	}
+#endif
+#if EE_RING_LOG
+	return eeprom_ring_advance();
+#else
+	dest = eeprom_get_next_page(page.idx);
+	eeprom_check_spare(dest);
+	return flash_copy_page(dest, FALSE);
+#endif
+}
+
+/**
+ * @fn static U8 eeprom_make_room(U16 size)
+ * @brief compact the active page if size bytes of records do not fit.
+ *
+ * @param size number of bytes about to be appended
+ *
+ * @return 0: success; 1: error, compaction failed or the records still do
+ *  not fit, nothing may be written
+ */
+static U8 eeprom_make_room(U16 size)
+{
+	if (page.tail + size <= EE_LOG_END)
+		return SUCCESS;
+	if (eeprom_compact())
+		return ERROR;
+#if EE_GC_RESERVE || EE_RING_LOG
+	/* Incremental compaction also kept the writes made while it ran, the
+	 * ring log may have carried values forward*/
+	if ((page.tail + size > EE_LOG_END) && eeprom_compact())
+		return ERROR;
+#endif
+	return (page.tail + size > EE_LOG_END) ? ERROR : SUCCESS;
+}
+
+#else
+/**
+ * @fn static U8 flash_copy_slots(EE_ADDR start, U8 len, const U8 *src)
+ * @brief move every value to slot 0 of its run on next page.
+ *
+ * Called when a run being written is exhausted or the mark byte of an
+ * address is used already when 0xFF is written to it. Every address which
+ * holds 0xFF gets the mark byte on the new page. The values being written
+ * replace the stored ones on the new page, so a
+ * block lands with the page switch. Source page is sealed first, so if
+ * both pages are ACTIVE after a power loss, eeprom_check_pages() keeps the
+ * new one. Each byte is read back as it is programmed. If one reads back
+ * wrong, the destination page is formatted and the source page stays
+ * active.
+ *
+ * @param start first address being written
+ * @param len number of bytes being written
+ * @param *src values being written
+ *
+ * @return 0: success; 1: error, destination page reads back wrong
+ */
+static U8 flash_copy_slots(EE_ADDR start, U8 len, const U8 *src)
+{
+	U16 dest, phy_addr;
+	EE_ADDR i;
+	U8 dat, written;
+	U8 bad = FALSE;
+
+	dest = eeprom_get_next_page(page.idx);
+	eeprom_check_spare(dest);
+#if EE_DEFER_ERASE
+	/* No stale sealed page may stay while the source is sealed*/
+	while (eeprom_idle_erase())
+		;
+#endif
+	if (flash_read_byte(page.addr + EE_SLOT_SEAL) == 0xFF)
+		flash_write_byte(page.addr + EE_SLOT_SEAL, 0x00);
+	/* Mark destination page as receiving status */
+	flash_write_byte(dest, PAGE_STATUS_RECEIVING);
+#if EE_COUNTERS
+	eeprom_counter_copy(dest);
+#endif
+	for (i = 0; i < EE_SIZE; i++) {
+		if ((i >= start) && (i - start < len)) {
+			dat = src[i - start];
+			written = TRUE;
+		} else {
+#if EE_SHADOW_ENABLE && EE_BITMAP_ENABLE
+			dat = ee_shadow[i];
+			written = EE_GET_BITMAP(ee_valid_map, i);
+#else
+			written = eeprom_slot_value(page.addr, i, &dat);
+#endif
+		}
+		if (dat != 0xFF) {
+			phy_addr = dest + EE_SLOT_BASE + (U16)i * EE_SLOTS_PER_ADDR;
+		} else if (written) {
+			phy_addr = dest + EE_SLOT_MARKS + i;
+			dat = 0;
+		} else {
+			continue;
+		}
+		flash_write_byte(phy_addr, dat);
+		if (flash_read_byte(phy_addr) != dat)
+			bad = TRUE;
+	}
+	/* Source page stays active, its seal only matters next to another
+	 * ACTIVE page*/
+	if (bad) {
+		eeprom_format_page(dest);
+		return ERROR;
+	}
+	/* Mark destination page as active status*/
+	flash_write_byte(dest, PAGE_STATUS_ACTIVE);
+	/* Erase source page and update erase count in page TAG position, or
+	 * leave it to eeprom_idle_erase()*/
+	eeprom_retire_page(page.addr);
+	i = (dest - EE_BASE_ADDR) / EE_PAGE_SIZE;
+	eeprom_update_page_info(i, dest, EE_SLOT_BASE);
+	return SUCCESS;
+}
+#endif
+
+/**
+ * @fn static void eeprom_cache_update(EE_ADDR log_addr, U8 byte)
+ * @brief update RAM caches after a value is written
+ *
+ * An address which the running incremental compaction copied already gets
+ * the value appended to the page being compacted as well.
+ *
+ * @param log_addr address in eeprom
+ * @param byte value written
+ *
+ * @return none
+ */
+static void eeprom_cache_update(EE_ADDR log_addr, U8 byte)
+{
+#if EE_SHADOW_ENABLE
+	ee_shadow[log_addr] = byte;
+#endif
+#if EE_BITMAP_ENABLE
+	EE_SET_BITMAP(ee_valid_map, log_addr);
+#endif
+#if EE_LRU_ENTRIES
+	eeprom_lru_update(log_addr, byte);
+#endif
+#if EE_GC_RESERVE
+	/* The write itself is done, a bad copy only gives the compaction up*/
+	if (gc_dest && (log_addr < gc_next))
+		eeprom_gc_put(log_addr, byte);
+#endif
+}
+
+#if EE_INPLACE_CLEAR
+/**
+ * @fn static U8 eeprom_clear_in_place(EE_ADDR log_addr, U8 byte)
+ * @brief reprogram the stored value of an address if the new value only
+ *  clears bits of it.
+ *
+ * @param log_addr address in eeprom
+ * @param byte value to write
+ *
+ * @return TRUE: value is programmed; FALSE: a new record is needed
+ */
+static U8 eeprom_clear_in_place(EE_ADDR log_addr, U8 byte)
+{
+	U16 phy_addr;
+	U8 dat;
+#if EE_LAYOUT == EE_LAYOUT_SLOTS
+	U8 used;
+#endif
+
+#if EE_BITMAP_ENABLE
+	/* Nothing stored to reprogram*/
+	if (!EE_GET_BITMAP(ee_valid_map, log_addr))
+		return FALSE;
+#endif
+#if EE_GC_RESERVE
+	/* The copy on the page being compacted takes a record, so does this one.
+	 * It bounds that page by the free records left on this one*/
+	if (gc_dest && (log_addr < gc_next))
+		return FALSE;
+#endif
+#if EE_LAYOUT == EE_LAYOUT_SLOTS
+	/* 0xFF is never programmed to a slot, it takes the mark byte*/
+	if (0xFF == byte)
+		return FALSE;
+	used = eeprom_slot_find(page.addr, log_addr, &dat);
+	/* A marked 0xFF is newer than the last used slot*/
+	if (!used || (0xFF == dat))
+		return FALSE;
+	phy_addr = page.addr + EE_SLOT_BASE +
+	           (U16)log_addr * EE_SLOTS_PER_ADDR + used - 1;
+#else
+	phy_addr = EE_FIND_RECORD(page.addr + page.tail - EE_VARIABLE_SIZE,
+	                          page.addr + EE_LOG_START, log_addr);
+	if (phy_addr) {
+		phy_addr += EE_DATA_OFFSET;
+		dat = flash_read_byte(phy_addr);
+	} else {
+#if EE_LAYOUT == EE_LAYOUT_SNAPSHOT
+		if (!eeprom_image_read(page.addr, log_addr, &dat))
+			return FALSE;
+		phy_addr = page.addr + EE_IMAGE_DATA + log_addr;
+#else
+		return FALSE;
+#endif
+	}
+#endif
+	if ((dat & byte) != byte)
+		return FALSE;
+	flash_write_byte(phy_addr, byte);
+	return TRUE;
+}
+#endif
+
+#if EE_LAYOUT != EE_LAYOUT_SLOTS
+/**
+ * @fn static U8 eeprom_append(EE_ADDR log_addr, U8 byte)
+ * @brief append a record to active page, see eeprom_make_room().
+ *
+ * @param log_addr address in eeprom
+ * @param byte value written
+ *
+ * @return 0: success; 1: error, the record does not fit and is not written
+ */
+static U8 eeprom_append(EE_ADDR log_addr, U8 byte)
+{
+	U16 phy_addr = page.addr + page.tail;
+
+	if (page.tail + EE_VARIABLE_SIZE > EE_LOG_END)
+		return ERROR;
+#if EE_ERASE_QUEUE
+	/* A full page looks replaced, so no replaced page may be left by then.
+	 * One queued page goes per record near the end, as the free records
+	 * left require, not all of them with the last record*/
+	if (page.tail + EE_PAGES * EE_VARIABLE_SIZE >= EE_LOG_END) {
+		while (eeprom_erase_pending() >= (EE_LOG_END - page.tail) / EE_VARIABLE_SIZE)
+			eeprom_erase_next();
+	}
+#endif
+	EE_WRITE_KEY(phy_addr, log_addr);
+	flash_write_byte(phy_addr + EE_DATA_OFFSET, byte);
+	page.tail += EE_VARIABLE_SIZE;
+	return SUCCESS;
+}
+
+/**
+ * @fn static U8 eeprom_diff_block(EE_ADDR start, U8 len, const U8 *src, U8 *changed_map)
+ * @brief find the addresses of a block whose stored value differs.
+ *
+ * Same rule as eeprom_write_byte(): an address is unchanged if it holds a
+ * written value equal to the new one. Without shadow cache it takes one
+ * backward pass of the page.
+ *
+ * @param start first address in eeprom
+ * @param len number of bytes
+ * @param *src new values
+ * @param *changed_map bitmap of EE_BITMAP_SIZE bytes, set for changed address
+ *
+ * @return number of changed addresses
+ */
+static U8 eeprom_diff_block(EE_ADDR start, U8 len, const U8 *src, U8 *changed_map)
+{
+	EE_ADDR i;
+	U8 count = 0;
+#if !EE_SHADOW_ENABLE
+	U16 phy_addr;
+	EE_ADDR log_addr;
+	U8 left;
+#if EE_LAYOUT == EE_LAYOUT_SNAPSHOT
+	U8 byte;
+#endif
+#endif
+
+	for (i = 0; i < EE_BITMAP_SIZE; i++) {
+		changed_map[i] = 0;
+	}
+#if EE_SHADOW_ENABLE
+	for (i = 0; i < len; i++) {
+		if ((ee_shadow[start + i] != src[i]) ||
+		    ((0xFF == src[i]) && !eeprom_is_written(start + i))) {
+			EE_SET_BITMAP(changed_map, start + i);
+			count++;
+		}
+	}
+#else
+	for (i = 0; i < EE_BITMAP_SIZE; i++) {
+		ee_scratch_map[i] = 0;
+	}
+	left = len;
+#if EE_BITMAP_ENABLE
+	/* Never written address always changes*/
+	for (i = 0; i < len; i++) {
+		if (!EE_GET_BITMAP(ee_valid_map, start + i)) {
+			EE_SET_BITMAP(ee_scratch_map, start + i);
+			EE_SET_BITMAP(changed_map, start + i);
+			count++;
+			left--;
+		}
+	}
+#endif
+	phy_addr = page.addr + page.tail - EE_VARIABLE_SIZE;
+	while (left && (phy_addr >= (page.addr + EE_LOG_START))) {
+		log_addr = EE_READ_KEY(phy_addr);
+		if ((log_addr >= start) && (log_addr - start < len) &&
+		    !EE_GET_BITMAP(ee_scratch_map, log_addr)) {
+			EE_SET_BITMAP(ee_scratch_map, log_addr);
+			left--;
+			if (flash_read_byte(phy_addr + EE_DATA_OFFSET) != src[log_addr - start]) {
+				EE_SET_BITMAP(changed_map, log_addr);
+				count++;
+			}
+		}
+		phy_addr -= EE_VARIABLE_SIZE;
+	}
+	for (i = 0; left && (i < len); i++) {
+		if (EE_GET_BITMAP(ee_scratch_map, start + i))
+			continue;
+		left--;
+#if EE_LAYOUT == EE_LAYOUT_SNAPSHOT
+		if (eeprom_image_read(page.addr, start + i, &byte) && (byte == src[i]))
+			continue;
+#endif
+		EE_SET_BITMAP(changed_map, start + i);
+		count++;
+	}
+#endif
+	return count;
 }
+#endif
 
 U8 eeprom_init()
 {
-    eeprom_check_pages();
+#if EE_ERASE_QUEUE
+    U8 i;
+    for (i = 0; i < (EE_PAGES + 7) / 8; i++) {
+    	erase_map[i] = 0;
+    }
+#endif
+#if EE_WRITE_BACK
+    wb_count = 0;
+#endif
+#if EE_GC_RESERVE
+    gc_dest = 0;
+#endif
+#if EE_TX_ENABLE
+    tx_open = FALSE;
+#endif
+    ee_readonly = FALSE;
+    if (eeprom_check_pages(FALSE))
+    	return ERROR;
+#if EE_TX_ENABLE
+    /* Records past the write pointer belong to a transaction which was not
+     * committed, compact the page without them*/
+    if ((page.tail < EE_LOG_END) &&
+        (flash_read_byte(page.addr + page.tail) != 0xFF)) {
+    	if (eeprom_compact())
+    		return ERROR;
+    }
+#endif
     return SUCCESS;
 }
 
-U8 eeprom_read_byte(U8 log_addr, U8 *byte)
+U8 eeprom_init_readonly()
+{
+#if EE_WRITE_BACK
+    wb_count = 0;
+#endif
+#if EE_GC_RESERVE
+    gc_dest = 0;
+#endif
+#if EE_TX_ENABLE
+    tx_open = FALSE;
+#endif
+    ee_readonly = TRUE;
+    return eeprom_check_pages(TRUE);
+}
+
+U8 eeprom_verify()
+{
+	U8 i;
+	U16 phy_addr;
+	if (ee_readonly)
+		return ERROR;
+
+	for (i = 0; i < EE_PAGES; i++) {
+		phy_addr = EE_BASE_ADDR + i * EE_PAGE_SIZE;
+		if ((phy_addr != page.addr) &&
+		    (flash_read_byte(phy_addr) == PAGE_STATUS_ERASED) &&
+		    !eeprom_is_formatted(phy_addr))
+			eeprom_format_page(phy_addr);
+	}
+	return SUCCESS;
+}
+
+U8 eeprom_read_byte(EE_ADDR log_addr, U8 *byte)
+{
+#if EE_WRITE_BACK
+	U8 i;
+#endif
+#if EE_SHADOW_ENABLE
+	if (log_addr >= EE_SIZE)
+		return ERROR;
+
+#if EE_WRITE_BACK
+	i = eeprom_wb_find(log_addr);
+	if (i < wb_count) {
+		*byte = wb_data[i];
+		return SUCCESS;
+	}
+#endif
+	*byte = ee_shadow[log_addr];
+	return SUCCESS;
+#else
+	if (log_addr >= EE_SIZE)
+		return ERROR;
+
+#if EE_WRITE_BACK
+	/* Pending value is newer than anything in flash*/
+	i = eeprom_wb_find(log_addr);
+	if (i < wb_count) {
+		*byte = wb_data[i];
+		return SUCCESS;
+	}
+#endif
+#if EE_BITMAP_ENABLE
+	/* Never written address holds erased value, no need to scan the page*/
+	if (!EE_GET_BITMAP(ee_valid_map, log_addr)) {
+		*byte = 0xFF;
+		return SUCCESS;
+	}
+#endif
+#if EE_LRU_ENTRIES
+	if (eeprom_lru_get(log_addr, byte)) {
+		lru_hits++;
+		return SUCCESS;
+	}
+	lru_misses++;
+#endif
+#if EE_LAYOUT == EE_LAYOUT_SLOTS
+	eeprom_slot_find(page.addr, log_addr, byte);
+#else
+	eeprom_find_value(log_addr, byte);
+#endif
+#if EE_LRU_ENTRIES
+	eeprom_lru_put(log_addr, *byte);
+#endif
+	return SUCCESS;
+#endif
+}
+
+/**
+ * @fn static U8 eeprom_program_byte(EE_ADDR log_addr, U8 byte)
+ * @brief program a value to flash, caller checks address and mount mode.
+ *
+ * @param log_addr address in eeprom
+ * @param byte value to write
+ *
+ * @return 0: success; 1: error
+ */
+static U8 eeprom_program_byte(EE_ADDR log_addr, U8 byte)
+{
+#if EE_LAYOUT == EE_LAYOUT_SLOTS
+	U8 used, mark;
+#elif !EE_RING_LOG
+	U16 phy_addr;
+#endif
+#if EE_WRITE_ELIDE || (EE_LAYOUT == EE_LAYOUT_SLOTS)
+	U8 dat;
+#endif
+#if EE_WRITE_ELIDE
+	U8 written;
+#endif
+#if EE_WRITE_ELIDE
+	/* Same value already stored, do not spend a record on it. A 0xFF write
+	 * to a never written address is kept so eeprom_is_written() sees it*/
+	written = eeprom_stored_value(log_addr, &dat);
+	if ((dat == byte) && ((byte != 0xFF) || written)) {
+		ee_elided++;
+		return SUCCESS;
+	}
+#endif
+#if EE_INPLACE_CLEAR
+	/* Only clears bits of the stored value, no new record needed*/
+	if (eeprom_clear_in_place(log_addr, byte)) {
+		eeprom_cache_update(log_addr, byte);
+		return SUCCESS;
+	}
+#endif
+#if EE_LAYOUT == EE_LAYOUT_SLOTS
+	used = eeprom_slot_find(page.addr, log_addr, &dat);
+	if (0xFF == byte) {
+		/* Erased value takes the mark byte of the address, it is free
+		 * once per page. The mark already equals used if 0xFF is stored*/
+		mark = flash_read_byte(page.addr + EE_SLOT_MARKS + log_addr);
+		if (0xFF == mark)
+			flash_write_byte(page.addr + EE_SLOT_MARKS + log_addr, used);
+		else if ((mark != used) && flash_copy_slots(log_addr, 1, &byte))
+			return ERROR;
+	} else if (used < EE_SLOTS_PER_ADDR) {
+		flash_write_byte(page.addr + EE_SLOT_BASE +
+		                 (U16)log_addr * EE_SLOTS_PER_ADDR + used, byte);
+	} else {
+		/* The run is exhausted, we need to find a new page*/
+		if (flash_copy_slots(log_addr, 1, &byte))
+			return ERROR;
+	}
+#else
+#if EE_GC_RESERVE
+	/* Running compaction is finished first, its page has room*/
+	if (gc_dest && (page.tail + EE_VARIABLE_SIZE > EE_LOG_END) &&
+	    eeprom_compact())
+		return ERROR;
+#endif
+#if EE_RING_LOG
+	if (eeprom_make_room(EE_VARIABLE_SIZE) || eeprom_append(log_addr, byte))
+		return ERROR;
+#else
+	/* The page is full, we need to find a new page*/
+	if(page.tail + EE_VARIABLE_SIZE > EE_LOG_END) {
+		phy_addr = eeprom_get_next_page(page.idx);
+		eeprom_check_spare(phy_addr);
+		EE_WRITE_KEY(phy_addr + EE_LOG_START, log_addr);
+		flash_write_byte(phy_addr + EE_LOG_START + EE_DATA_OFFSET, byte);
+		if (flash_copy_page(phy_addr, TRUE))
+			return ERROR;
+	}else if (eeprom_append(log_addr, byte)) {
+		return ERROR;
+	}
+#endif
+#endif
+	eeprom_cache_update(log_addr, byte);
+	return SUCCESS;
+}
+
+U8 eeprom_write_byte(EE_ADDR log_addr, U8 byte)
+{
+#if EE_WRITE_BACK
+	U8 i;
+#endif
+	if ((log_addr >= EE_SIZE) || ee_readonly)
+		return ERROR;
+
+#if EE_WRITE_BACK
+	i = eeprom_wb_find(log_addr);
+	if (i < wb_count) {
+		/* Rewrite of a pending address costs no flash write*/
+		wb_data[i] = byte;
+		wb_coalesced++;
+		return SUCCESS;
+	}
+	if ((wb_count >= EE_WB_ENTRIES) && eeprom_flush())
+		return ERROR;
+	if (0 == wb_count)
+		wb_age = 0;
+	wb_addr[wb_count] = log_addr;
+	wb_data[wb_count] = byte;
+	wb_count++;
+	return SUCCESS;
+#else
+	return eeprom_program_byte(log_addr, byte);
+#endif
+}
+
+U8 eeprom_clear_bits(EE_ADDR log_addr, U8 mask)
+{
+	U8 byte;
+	if (eeprom_read_byte(log_addr, &byte))
+		return ERROR;
+	return eeprom_write_byte(log_addr, byte & ~mask);
+}
+
+U8 eeprom_set_bits(EE_ADDR log_addr, U8 mask)
+{
+	U8 byte;
+	if (eeprom_read_byte(log_addr, &byte))
+		return ERROR;
+	return eeprom_write_byte(log_addr, byte | mask);
+}
+
+U8 eeprom_counter_inc(U8 id)
+{
+#if EE_COUNTERS
+	U16 field;
+	U8 i, byte;
+	if ((id >= EE_COUNTERS) || ee_readonly)
+		return ERROR;
+
+	field = page.addr + EE_COUNTER_AREA + (U16)id * EE_COUNTER_SIZE + 4;
+	i = eeprom_counter_find(field);
+	if (i == EE_COUNTER_BYTES) {
+		/* Bitfield is full, compaction folds it into the base*/
+#if EE_LAYOUT == EE_LAYOUT_SLOTS
+		if (flash_copy_slots(0, 0, &byte))
+			return ERROR;
+#else
+		if (eeprom_compact())
+			return ERROR;
+#endif
+		field = page.addr + EE_COUNTER_AREA + (U16)id * EE_COUNTER_SIZE + 4;
+		i = 0;
+	}
+	/* Clear lowest set bit, a single byte program*/
+	byte = flash_read_byte(field + i);
+	flash_write_byte(field + i, byte & (U8)(byte << 1));
+	return SUCCESS;
+#else
+	return ERROR;
+#endif
+}
+
+U8 eeprom_counter_read(U8 id, U32 *value)
+{
+#if EE_COUNTERS
+	if (id >= EE_COUNTERS)
+		return ERROR;
+	*value = eeprom_counter_value(page.addr, id);
+	return SUCCESS;
+#else
+	return ERROR;
+#endif
+}
+
+U8 eeprom_flush()
+{
+#if EE_WRITE_BACK
+	U8 i, j;
+	for (i = 0; i < wb_count; i++) {
+		if (eeprom_program_byte(wb_addr[i], wb_data[i]))
+			break;
+		wb_flushed++;
+	}
+	/* A failed entry and the ones after it stay pending, in order*/
+	for (j = 0; i < wb_count; i++, j++) {
+		wb_addr[j] = wb_addr[i];
+		wb_data[j] = wb_data[i];
+	}
+	wb_count = j;
+	if (wb_count)
+		return ERROR;
+#endif
+	return SUCCESS;
+}
+
+U8 eeprom_tick()
+{
+#if EE_WRITE_BACK
+	if (wb_count && (++wb_age >= EE_WB_TICKS))
+		return eeprom_flush();
+#endif
+	return SUCCESS;
+}
+
+U8 eeprom_idle_erase()
+{
+#if EE_ERASE_QUEUE
+	if (ee_readonly)
+		return FALSE;
+	eeprom_erase_next();
+	return eeprom_erase_pending() ? TRUE : FALSE;
+#else
+	return FALSE;
+#endif
+}
+
+U8 eeprom_maintenance(U16 max_steps)
+{
+#if EE_GC_RESERVE
+	if (ee_readonly)
+		return FALSE;
+	for (; max_steps; max_steps--) {
+		/* Replaced page is erased in a step of its own, before the next
+		 * compaction may pick it*/
+		if (!gc_dest && eeprom_erase_next())
+			continue;
+		/* Start once fewer than EE_GC_RESERVE records are left*/
+		if (!gc_dest &&
+		    (page.tail + EE_GC_RESERVE * EE_VARIABLE_SIZE <= EE_LOG_END))
+			break;
+		eeprom_gc_step();
+	}
+	return (gc_dest || eeprom_erase_pending()) ? TRUE : FALSE;
+#else
+	return FALSE;
+#endif
+}
+
+U8 eeprom_write_block(EE_ADDR start, U8 len, const U8 *src)
+{
+	U8 i;
+#if EE_LAYOUT == EE_LAYOUT_SLOTS
+	U8 used, dat;
+#else
+	U8 count;
+	static SEGMENT_VARIABLE(changed_map[EE_BITMAP_SIZE], U8, SEG_XDATA);
+#endif
+	if (((U16)start + len > EE_SIZE) || ee_readonly)
+		return ERROR;
+
+#if EE_WRITE_BACK
+	/* The block supersedes pending writes in its range*/
+	eeprom_wb_drop(start, len);
+#endif
+#if EE_LAYOUT == EE_LAYOUT_SLOTS
+	/* Check every run or mark byte has room before the first byte is
+	 * programmed. If one has not, a single page copy takes the whole block.*/
+	for (i = 0; i < len; i++) {
+		used = eeprom_slot_find(page.addr, start + i, &dat);
+		if (dat == src[i])
+			continue;
+		if ((0xFF == src[i]) ?
+		    (flash_read_byte(page.addr + EE_SLOT_MARKS + start + i) != 0xFF) :
+		    (used >= EE_SLOTS_PER_ADDR))
+			break;
+	}
+	if (i < len) {
+		if (flash_copy_slots(start, len, src))
+			return ERROR;
+		for (i = 0; i < len; i++) {
+			eeprom_cache_update(start + i, src[i]);
+		}
+		return SUCCESS;
+	}
+	for (i = 0; i < len; i++) {
+		if (eeprom_program_byte(start + i, src[i]))
+			return ERROR;
+	}
+#else
+	count = eeprom_diff_block(start, len, src, changed_map);
+#if EE_WRITE_ELIDE
+	ee_elided += len - count;
+#endif
+	if (0 == count)
+		return SUCCESS;
+	/* One capacity check for the whole block, compact first if it does not
+	 * fit. A compacted page has room for EE_SIZE records, see EE_SIZE.*/
+	if (eeprom_make_room((U16)count * EE_VARIABLE_SIZE))
+		return ERROR;
+	for (i = 0; i < len; i++) {
+		if (EE_GET_BITMAP(changed_map, start + i)) {
+			if (eeprom_append(start + i, src[i]))
+				return ERROR;
+			eeprom_cache_update(start + i, src[i]);
+		}
+	}
+#endif
+	return SUCCESS;
+}
+
+#if EE_TX_ENABLE
+/**
+ * @fn static U8 eeprom_tx_program(EE_ADDR *addr, U8 *dat, U8 count)
+ * @brief program a group of writes between a begin record and its commit
+ *  marker.
+ *
+ * Writes of values already stored are dropped first, the arrays are
+ * compacted in place.
+ *
+ * @param *addr addresses in eeprom, each one once
+ * @param *dat values written
+ * @param count number of writes, EE_TX_GROUP or less
+ *
+ * @return 0: success; 1: error, no write of the group is visible
+ */
+static U8 eeprom_tx_program(EE_ADDR *addr, U8 *dat, U8 count)
 {
+	U8 i, n;
 	U16 phy_addr;
+#if EE_WRITE_ELIDE
+	U8 byte, written;
+#endif
+	n = 0;
+	for (i = 0; i < count; i++) {
+#if EE_WRITE_ELIDE
+		written = eeprom_stored_value(addr[i], &byte);
+		if ((byte == dat[i]) && ((dat[i] != 0xFF) || written)) {
+			ee_elided++;
+			continue;
+		}
+#endif
+		addr[n] = addr[i];
+		dat[n] = dat[i];
+		n++;
+	}
+	if (0 == n)
+		return SUCCESS;
+	/* A transaction never spans a compaction, make room first*/
+	if (eeprom_make_room((U16)(n + 1) * EE_VARIABLE_SIZE))
+		return ERROR;
+	/* Begin record is left without data until all records are programmed*/
+	phy_addr = page.addr + page.tail;
+	EE_WRITE_KEY(phy_addr, EE_TX_BEGIN);
+	page.tail += EE_VARIABLE_SIZE;
+	for (i = 0; i < n; i++) {
+		/* Without the commit marker the records are ignored*/
+		if (eeprom_append(addr[i], dat[i]))
+			return ERROR;
+	}
+	/* Commit marker, this single byte makes the whole group visible*/
+	flash_write_byte(phy_addr + EE_DATA_OFFSET, n);
+	for (i = 0; i < n; i++) {
+		eeprom_cache_update(addr[i], dat[i]);
+	}
+	return SUCCESS;
+}
+#endif
+
+U8 eeprom_tx_begin()
+{
+#if EE_TX_ENABLE
+	if (ee_readonly)
+		return ERROR;
+	tx_count = 0;
+	tx_open = TRUE;
+	return SUCCESS;
+#else
+	return ERROR;
+#endif
+}
+
+U8 eeprom_tx_write(EE_ADDR log_addr, U8 byte)
+{
+#if EE_TX_ENABLE
+	U8 i;
+	if (!tx_open || (log_addr >= EE_SIZE))
+		return ERROR;
+	for (i = 0; i < tx_count; i++) {
+		if (tx_addr[i] == log_addr)
+			break;
+	}
+	if (i == tx_count) {
+		if (tx_count >= EE_TX_ENTRIES)
+			return ERROR;
+		tx_addr[i] = log_addr;
+		tx_count++;
+	}
+	tx_data[i] = byte;
+	return SUCCESS;
+#else
+	return ERROR;
+#endif
+}
+
+U8 eeprom_tx_commit()
+{
+#if EE_TX_ENABLE
+	if (!tx_open || ee_readonly)
+		return ERROR;
+#if EE_WRITE_BACK
+	/* Older pending writes must not land after the transaction. If they
+	 * cannot be programmed the transaction stays open for a retry.*/
+	if (eeprom_flush())
+		return ERROR;
+#endif
+	tx_open = FALSE;
+	return eeprom_tx_program(tx_addr, tx_data, tx_count);
+#else
+	return ERROR;
+#endif
+}
+
+U8 eeprom_is_written(EE_ADDR log_addr)
+{
+#if EE_WRITE_BACK
+	U8 i;
+#endif
+#if !EE_BITMAP_ENABLE
+	U8 byte;
+#endif
 	if (log_addr >= EE_SIZE)
+		return FALSE;
+
+#if EE_WRITE_BACK
+	i = eeprom_wb_find(log_addr);
+	if (i < wb_count)
+		return TRUE;
+#endif
+#if EE_BITMAP_ENABLE
+	return EE_GET_BITMAP(ee_valid_map, log_addr) ? TRUE : FALSE;
+#elif EE_LAYOUT == EE_LAYOUT_SLOTS
+	return eeprom_slot_value(page.addr, log_addr, &byte);
+#else
+	return eeprom_find_value(log_addr, &byte);
+#endif
+}
+
+U8 eeprom_read_block(EE_ADDR start, U8 len, U8 *dst)
+{
+	EE_ADDR i;
+#if !EE_SHADOW_ENABLE && (EE_LAYOUT != EE_LAYOUT_SLOTS)
+	U16 phy_addr;
+	EE_ADDR log_addr;
+	U8 left;
+#endif
+	if ((U16)start + len > EE_SIZE)
 		return ERROR;
 
+#if EE_SHADOW_ENABLE
+	for (i = 0; i < len; i++) {
+		dst[i] = ee_shadow[start + i];
+	}
+#elif EE_LAYOUT == EE_LAYOUT_SLOTS
+	/* Each run is short, no page scan to share*/
+	for (i = 0; i < len; i++) {
+		eeprom_slot_find(page.addr, start + i, &dst[i]);
+	}
+#else
+	for (i = 0; i < EE_BITMAP_SIZE; i++) {
+		ee_scratch_map[i] = 0;
+	}
+	/* Addresses never written are resolved up front with erased value*/
+	left = 0;
+	for (i = 0; i < len; i++) {
+		dst[i] = 0xFF;
+#if EE_BITMAP_ENABLE
+		if (!EE_GET_BITMAP(ee_valid_map, start + i)) {
+			EE_SET_BITMAP(ee_scratch_map, start + i);
+			continue;
+		}
+#endif
+		left++;
+	}
+	/* One backward pass, newest record of each address wins*/
 	phy_addr = page.addr + page.tail - EE_VARIABLE_SIZE;
-	while(phy_addr >= (page.addr + EE_TAG_SIZE)){
-		if (log_addr == flash_read_byte(phy_addr)) {
-			*byte = flash_read_byte(phy_addr + 1);
-			return SUCCESS;
+	while (left && (phy_addr >= (page.addr + EE_LOG_START))) {
+		log_addr = EE_READ_KEY(phy_addr);
+		if ((log_addr >= start) && (log_addr - start < len)) {
+			if (!EE_GET_BITMAP(ee_scratch_map, log_addr)) {
+				dst[log_addr - start] = flash_read_byte(phy_addr + EE_DATA_OFFSET);
+				EE_SET_BITMAP(ee_scratch_map, log_addr);
+				left--;
+			}
 		}
 		phy_addr -= EE_VARIABLE_SIZE;
 	}
-	*byte = 0xFF;
+#if EE_LAYOUT == EE_LAYOUT_SNAPSHOT
+	/* The rest come from snapshot image*/
+	for (i = 0; left && (i < len); i++) {
+		if (!EE_GET_BITMAP(ee_scratch_map, start + i)) {
+			eeprom_image_read(page.addr, start + i, &dst[i]);
+			left--;
+		}
+	}
+#endif
+#endif
+#if EE_WRITE_BACK
+	/* Pending values override what flash holds*/
+	for (i = 0; i < wb_count; i++) {
+		if ((wb_addr[i] >= start) && (wb_addr[i] - start < len))
+			dst[wb_addr[i] - start] = wb_data[i];
+	}
+#endif
 	return SUCCESS;
 }
 
-U8 eeprom_write_byte(U8 log_addr, U8 byte)
+#if EE_WIDE_RECORDS
+/**
+ * @fn static U8 eeprom_write_wide(EE_ADDR log_addr, U8 len, U8 *src)
+ * @brief write the changed part of a 2 or 4 bytes value as one record.
+ *
+ * One changed byte takes a byte record, two adjacent ones a 2 bytes record,
+ * anything else a 4 bytes record. Data is programmed before the key, so a
+ * reset in between leaves the old value, see eeprom_skip_torn().
+ *
+ * @param log_addr first address of the value
+ * @param len 2 or 4
+ * @param *src new value, MSB first
+ *
+ * @return 0: success; 1: error
+ */
+static U8 eeprom_write_wide(EE_ADDR log_addr, U8 len, U8 *src)
 {
 	U16 phy_addr;
-	if (log_addr >= EE_SIZE)
+	U8 first, last, size, key, i;
+
+#if EE_WRITE_BACK
+	/* The value supersedes pending writes of its bytes*/
+	eeprom_wb_drop(log_addr, len);
+#endif
+	first = len;
+	last = 0;
+	for (i = 0; i < len; i++) {
+		if ((ee_shadow[log_addr + i] != src[i]) ||
+		    !EE_GET_BITMAP(ee_valid_map, log_addr + i)) {
+			if (first == len)
+				first = i;
+			last = i;
+		}
+	}
+	if (first == len) {
+#if EE_WRITE_ELIDE
+		ee_elided++;
+#endif
+		return SUCCESS;
+	}
+	size = last - first + 1;
+	if (size > 2) {
+		first = 0;
+		size = 4;
+	}
+	key = (4 == size) ? EE_KEY_U32 : (2 == size) ? EE_KEY_U16 : 0;
+	key |= log_addr + first;
+
+	if (eeprom_make_room(1 + size))
+		return ERROR;
+	phy_addr = page.addr + page.tail;
+	for (i = 0; i < size; i++) {
+		flash_write_byte(phy_addr + 1 + i, src[first + i]);
+	}
+	/* Key last, it makes the whole record valid*/
+	flash_write_byte(phy_addr, key);
+	page.tail += 1 + size;
+	for (i = 0; i < size; i++) {
+		eeprom_cache_update(log_addr + first + i, src[first + i]);
+	}
+	return SUCCESS;
+}
+#endif
+
+#if !EE_WIDE_RECORDS && EE_TX_ENABLE
+/**
+ * @fn static U8 eeprom_write_group(EE_ADDR start, U8 len, U8 *src)
+ * @brief write a typed value as one transaction, see eeprom_tx_commit().
+ *
+ * An open transaction is not touched.
+ *
+ * @param start first address of the value
+ * @param len number of bytes, 2 or 4
+ * @param *src value MSB first, writes already stored are dropped from it
+ *
+ * @return 0: success; 1: error
+ */
+static U8 eeprom_write_group(EE_ADDR start, U8 len, U8 *src)
+{
+	EE_ADDR addr[4];
+	U8 i;
+
+#if EE_WRITE_BACK
+	/* Pending writes of the value must not land after it*/
+	if (eeprom_flush())
 		return ERROR;
+#endif
+	for (i = 0; i < len; i++) {
+		addr[i] = start + i;
+	}
+	return eeprom_tx_program(addr, src, len);
+}
+#endif
 
-	/* The page is full, we need to find a new page*/
-	if(page.tail >= FL_PAGE_SIZE) {
-		phy_addr = eeprom_get_next_page(page.idx) + EE_TAG_SIZE;
-		flash_write_byte(phy_addr, log_addr);
-		flash_write_byte(phy_addr + 1, byte);
-		flash_copy_page();
-	}else{
-		phy_addr = page.addr + page.tail;
-		flash_write_byte(phy_addr, log_addr);
-		flash_write_byte(phy_addr + 1, byte);
-		page.tail += EE_VARIABLE_SIZE;
+#if EE_WIDE_RECORDS || EE_TX_ENABLE
+U8 eeprom_write_u16(EE_ADDR log_addr, U16 value)
+{
+	U8 buf[2];
+	if (((U16)log_addr + 2 > EE_SIZE) || ee_readonly)
+		return ERROR;
+
+	buf[0] = (U8)(value >> 8);
+	buf[1] = (U8)value;
+#if EE_WIDE_RECORDS
+	return eeprom_write_wide(log_addr, 2, buf);
+#else
+	return eeprom_write_group(log_addr, 2, buf);
+#endif
+}
+
+U8 eeprom_write_u32(EE_ADDR log_addr, U32 value)
+{
+	U8 buf[4];
+	U8 i;
+	if (((U16)log_addr + 4 > EE_SIZE) || ee_readonly)
+		return ERROR;
+
+	for (i = 0; i < 4; i++) {
+		buf[i] = (U8)(value >> 24);
+		value <<= 8;
+	}
+#if EE_WIDE_RECORDS
+	return eeprom_write_wide(log_addr, 4, buf);
+#else
+	return eeprom_write_group(log_addr, 4, buf);
+#endif
+}
+#endif
+
+U8 eeprom_read_u16(EE_ADDR log_addr, U16 *value)
+{
+	U8 buf[2];
+	if (eeprom_read_block(log_addr, 2, buf))
+		return ERROR;
+	*value = ((U16)buf[0] << 8) | buf[1];
+	return SUCCESS;
+}
+
+U8 eeprom_read_u32(EE_ADDR log_addr, U32 *value)
+{
+	U8 buf[4];
+	U8 i;
+	if (eeprom_read_block(log_addr, 4, buf))
+		return ERROR;
+	*value = 0;
+	for (i = 0; i < 4; i++) {
+		*value = (*value << 8) | buf[i];
+	}
+	return SUCCESS;
+}
+
+U8 eeprom_put(U8 id, const U8 *buf, U8 len)
+{
+#if EE_BLOBS
+	U16 phy_addr;
+	U8 i;
+	if ((id >= EE_BLOBS) || (len > EE_BLOB_MAX) || ee_readonly)
+		return ERROR;
+
+#if EE_WRITE_ELIDE
+	phy_addr = page.addr + blob_pos[id];
+	if (blob_pos[id] && (flash_read_byte(phy_addr + 2) == len)) {
+		for (i = 0; i < len; i++) {
+			if (flash_read_byte(phy_addr + EE_BLOB_HEAD + i) != buf[i])
+				break;
+		}
+		if (i == len) {
+			ee_elided++;
+			return SUCCESS;
+		}
+	}
+#endif
+	if (eeprom_make_room(EE_BLOB_HEAD + len))
+		return ERROR;
+	/* Open key and length first, so mount can step over a torn blob*/
+	phy_addr = page.addr + page.tail;
+	flash_write_byte(phy_addr, EE_KEY_BLOB_OPEN);
+	flash_write_byte(phy_addr + 2, len);
+	flash_write_byte(phy_addr + 1, id);
+	for (i = 0; i < len; i++) {
+		flash_write_byte(phy_addr + EE_BLOB_HEAD + i, buf[i]);
+	}
+	/* Clearing bit 0 of the key commits the blob*/
+	flash_write_byte(phy_addr, EE_KEY_BLOB);
+	blob_pos[id] = page.tail;
+	page.tail += EE_BLOB_HEAD + len;
+	return SUCCESS;
+#else
+	return ERROR;
+#endif
+}
+
+U8 eeprom_get(U8 id, U8 *buf, U8 maxlen, U8 *len)
+{
+#if EE_BLOBS
+	U16 phy_addr;
+	U8 i;
+	if ((id >= EE_BLOBS) || !blob_pos[id])
+		return ERROR;
+
+	phy_addr = page.addr + blob_pos[id];
+	*len = flash_read_byte(phy_addr + 2);
+	for (i = 0; (i < *len) && (i < maxlen); i++) {
+		buf[i] = flash_read_byte(phy_addr + EE_BLOB_HEAD + i);
 	}
 	return SUCCESS;
+#else
+	return ERROR;
+#endif
+}
+
+U16 eeprom_get_elided_writes()
+{
+#if EE_WRITE_ELIDE
+	U16 count = ee_elided;
+	ee_elided = 0;
+	return count;
+#else
+	return 0;
+#endif
+}
+
+void eeprom_get_wb_stats(U16 *coalesced, U16 *flushed)
+{
+#if EE_WRITE_BACK
+	*coalesced = wb_coalesced;
+	*flushed = wb_flushed;
+	wb_coalesced = 0;
+	wb_flushed = 0;
+#else
+	*coalesced = 0;
+	*flushed = 0;
+#endif
+}
+
+void eeprom_get_lru_stats(U16 *hits, U16 *misses)
+{
+#if EE_LRU_ENTRIES
+	*hits = lru_hits;
+	*misses = lru_misses;
+	lru_hits = 0;
+	lru_misses = 0;
+#else
+	*hits = 0;
+	*misses = 0;
+#endif
+}
+
+void eeprom_get_wear_stats(U32 *least, U32 *most)
+{
+	U8 i;
+	U32 count;
+	*least = 0xFFFFFFFF;
+	*most = 0;
+	for (i = 0; i < EE_PAGES; i++) {
+#if EE_WEAR_LEVEL
+		count = wear_count[i];
+#else
+		count = eeprom_erase_count(EE_BASE_ADDR + i * EE_PAGE_SIZE);
+#endif
+		if (count < *least)
+			*least = count;
+		if (count > *most)
+			*most = count;
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -23,16 +23,42 @@
  * @brief
  *   It restores the pages to good state in case of page status corruption
  * after a power loss or unwanted system reset.And also it will create bit map
- * for those address which has valid value inside. With the bit map, eeprom read
- * function can check the bit map instead of checking contents in eeprom. Which
- * will definitely save time cost.
+ * for those address which has valid value inside (EE_BITMAP_ENABLE). With the
+ * bit map, eeprom read function can check the bit map instead of checking
+ * contents in eeprom. Which will definitely save time cost. Without the bit
+ * map and EE_SHADOW_ENABLE it only looks up the write pointer of the active
+ * page, by binary search. Pending writes of EE_WRITE_BACK are discarded.
  *
  * @return 0: success; 1: error
  */
 extern U8 eeprom_init();
 
 /**
- * @fn U8 eeprom_write_byte(U8 log_addr, U8 byte)
+ * @fn U8 eeprom_init_readonly()
+ * @brief Mount the eeprom without programming or erasing flash.
+ *
+ * It selects the page eeprom_init() would keep, without repairing the others,
+ * and serves reads from it. Every write returns error until eeprom_init() is
+ * called. Use it for diagnostics or bootloader stage reads, e.g. while supply
+ * may not be stable enough for a page erase.
+ *
+ * @return 0: success; 1: error, no page holds consistent data
+ */
+extern U8 eeprom_init_readonly();
+
+/**
+ * @fn U8 eeprom_verify()
+ * @brief Blank check every spare page and format the ones which are not.
+ *
+ * eeprom_init() skips this check when EE_FAST_MOUNT is set, call it at a
+ * convenient time to get the full mount check.
+ *
+ * @return 0: success; 1: error
+ */
+extern U8 eeprom_verify();
+
+/**
+ * @fn U8 eeprom_write_byte(EE_ADDR log_addr, U8 byte)
  * @brief eeprom byte write interface
  *
  * It writes a byte to eeprom
@@ -42,10 +68,165 @@ extern U8 eeprom_init();
  *
  * @return 0: success; 1: error
  */
-extern U8 eeprom_write_byte(U8 log_addr, U8 byte);
+extern U8 eeprom_write_byte(EE_ADDR log_addr, U8 byte);
+
+/**
+ * @fn U8 eeprom_clear_bits(EE_ADDR log_addr, U8 mask)
+ * @brief Clear the bits of mask in a stored byte
+ *
+ * With EE_INPLACE_CLEAR the stored byte is reprogrammed, no new record is
+ * written.
+ *
+ * @param log_addr address in eeprom.
+ * @param mask bits to clear.
+ *
+ * @return 0: success; 1: error
+ */
+extern U8 eeprom_clear_bits(EE_ADDR log_addr, U8 mask);
+
+/**
+ * @fn U8 eeprom_set_bits(EE_ADDR log_addr, U8 mask)
+ * @brief Set the bits of mask in a stored byte
+ *
+ * Setting bits needs a new record, unless they are all set already.
+ *
+ * @param log_addr address in eeprom.
+ * @param mask bits to set.
+ *
+ * @return 0: success; 1: error
+ */
+extern U8 eeprom_set_bits(EE_ADDR log_addr, U8 mask);
+
+/**
+ * @fn U8 eeprom_counter_inc(U8 id)
+ * @brief Add one to a unary counter (EE_COUNTERS)
+ *
+ * An increment programs a single bit, a compaction is done every
+ * EE_COUNTER_BYTES * 8 increments.
+ *
+ * @param id counter number, less than EE_COUNTERS.
+ *
+ * @return 0: success; 1: error
+ */
+extern U8 eeprom_counter_inc(U8 id);
+
+/**
+ * @fn U8 eeprom_counter_read(U8 id, U32 *value)
+ * @brief Read a unary counter (EE_COUNTERS)
+ *
+ * @param id counter number, less than EE_COUNTERS.
+ * @param *value pointer to counter value.
+ *
+ * @return 0: success; 1: error
+ */
+extern U8 eeprom_counter_read(U8 id, U32 *value);
+
+/**
+ * @fn U8 eeprom_flush()
+ * @brief Program all pending writes to flash (EE_WRITE_BACK)
+ *
+ * Call it before power down or reset. It does nothing in write-through mode.
+ * If a write fails, it and the writes after it stay pending.
+ *
+ * @return 0: success; 1: error, some writes are still pending
+ */
+extern U8 eeprom_flush();
+
+/**
+ * @fn U8 eeprom_tick()
+ * @brief Application tick for the write-back buffer (EE_WRITE_BACK)
+ *
+ * Pending writes are flushed EE_WB_TICKS ticks after the first one was
+ * buffered. A failed flush is retried on the next tick.
+ *
+ * @return 0: success; 1: error, result of eeprom_flush()
+ */
+extern U8 eeprom_tick();
+
+/**
+ * @fn U8 eeprom_idle_erase()
+ * @brief Erase one page left behind by a compaction (EE_DEFER_ERASE)
+ *
+ * Call it when the application can afford a page erase, e.g. in idle time.
+ * It also erases the pages eeprom_maintenance() left. It does nothing when
+ * both EE_DEFER_ERASE and EE_GC_RESERVE are 0.
+ *
+ * @return 0: no page waits for erase; 1: more pages wait, call it again
+ */
+extern U8 eeprom_idle_erase();
+
+/**
+ * @fn U8 eeprom_maintenance(U16 max_steps)
+ * @brief Run the incremental compaction (EE_GC_RESERVE) from the main loop
+ *
+ * Once fewer than EE_GC_RESERVE records are free it copies the live values
+ * to the next page, at most max_steps at a time. A step copies one address,
+ * the first step prepares the page and the last one activates it. Erase of
+ * the old page is a step of its own, so no step takes longer than a page
+ * erase. Writes never wait for a whole compaction if it is called often
+ * enough. It does nothing when EE_GC_RESERVE is 0.
+ *
+ * @param max_steps maximum number of steps for this call.
+ *
+ * @return 0: nothing left to do; 1: compaction running or a page waits for
+ *  erase, call it again
+ */
+extern U8 eeprom_maintenance(U16 max_steps);
+
+/**
+ * @fn U8 eeprom_write_block(EE_ADDR start, U8 len, const U8 *src)
+ * @brief eeprom block write interface
+ *
+ * It compares the block with stored values and writes only the changed
+ * bytes. Free space is checked once, the page is compacted before the first
+ * write if the changed bytes do not fit, never in the middle of the block.
+ *
+ * @param start first address in eeprom for data write in.
+ * @param len number of bytes to write.
+ * @param *src pointer to len bytes of data.
+ *
+ * @return 0: success; 1: error
+ */
+extern U8 eeprom_write_block(EE_ADDR start, U8 len, const U8 *src);
+
+/**
+ * @fn U8 eeprom_tx_begin()
+ * @brief Open a transaction (EE_TX_ENABLE)
+ *
+ * A transaction which is already open is discarded.
+ *
+ * @return 0: success; 1: error
+ */
+extern U8 eeprom_tx_begin();
+
+/**
+ * @fn U8 eeprom_tx_write(EE_ADDR log_addr, U8 byte)
+ * @brief Add a byte to the open transaction (EE_TX_ENABLE)
+ *
+ * The value is kept in RAM, reads see the old value until commit.
+ *
+ * @param log_addr address in eeprom for data write in.
+ * @param byte byte data write into eeprom.
+ *
+ * @return 0: success; 1: error, no open transaction or EE_TX_ENTRIES
+ *  addresses already in it
+ */
+extern U8 eeprom_tx_write(EE_ADDR log_addr, U8 byte);
 
 /**
- * @fn U8 eeprom_read_byte(U8 log_addr, U8 *byte)
+ * @fn U8 eeprom_tx_commit()
+ * @brief Write all bytes of the open transaction at once (EE_TX_ENABLE)
+ *
+ * After a reset either all or none of the bytes hold the new value. With
+ * EE_WRITE_BACK the pending writes are flushed first, if that fails the
+ * transaction stays open.
+ *
+ * @return 0: success; 1: error
+ */
+extern U8 eeprom_tx_commit();
+
+/**
+ * @fn U8 eeprom_read_byte(EE_ADDR log_addr, U8 *byte)
  * @brief eeprom byte read interface
  *
  * It read a byte from eeprom
@@ -55,7 +236,164 @@ extern U8 eeprom_write_byte(U8 log_addr, U8 byte);
  *
  * @return 0: success; 1: error
  */
-extern U8 eeprom_read_byte(U8 log_addr, U8 *byte);
+extern U8 eeprom_read_byte(EE_ADDR log_addr, U8 *byte);
+
+/**
+ * @fn U8 eeprom_read_block(EE_ADDR start, U8 len, U8 *dst)
+ * @brief eeprom block read interface
+ *
+ * It reads len bytes starting at start in one backward pass of the page,
+ * never written addresses read as 0xFF.
+ *
+ * @param start first address in eeprom for data read out.
+ * @param len number of bytes to read.
+ * @param *dst pointer to buffer of at least len bytes.
+ *
+ * @return 0: success; 1: error
+ */
+extern U8 eeprom_read_block(EE_ADDR start, U8 len, U8 *dst);
+
+#if EE_WIDE_RECORDS || EE_TX_ENABLE
+/**
+ * @fn U8 eeprom_write_u16(EE_ADDR log_addr, U16 value)
+ * @brief Write a 16 bit value to two addresses, MSB first
+ *
+ * Only the changed bytes are written and a reset during the write leaves
+ * the old value. With EE_WIDE_RECORDS they go as one record, otherwise as
+ * a transaction of their own, see eeprom_tx_commit(). It only exists with
+ * EE_WIDE_RECORDS or EE_TX_ENABLE.
+ *
+ * @param log_addr first address of the value.
+ * @param value value to write.
+ *
+ * @return 0: success; 1: error
+ */
+extern U8 eeprom_write_u16(EE_ADDR log_addr, U16 value);
+
+/**
+ * @fn U8 eeprom_write_u32(EE_ADDR log_addr, U32 value)
+ * @brief Write a 32 bit value to four addresses, MSB first
+ *
+ * Same as eeprom_write_u16().
+ *
+ * @param log_addr first address of the value.
+ * @param value value to write.
+ *
+ * @return 0: success; 1: error
+ */
+extern U8 eeprom_write_u32(EE_ADDR log_addr, U32 value);
+#endif
+
+/**
+ * @fn U8 eeprom_read_u16(EE_ADDR log_addr, U16 *value)
+ * @brief Read a 16 bit value from two addresses, MSB first
+ *
+ * @param log_addr first address of the value.
+ * @param *value pointer to value read.
+ *
+ * @return 0: success; 1: error
+ */
+extern U8 eeprom_read_u16(EE_ADDR log_addr, U16 *value);
+
+/**
+ * @fn U8 eeprom_read_u32(EE_ADDR log_addr, U32 *value)
+ * @brief Read a 32 bit value from four addresses, MSB first
+ *
+ * @param log_addr first address of the value.
+ * @param *value pointer to value read.
+ *
+ * @return 0: success; 1: error
+ */
+extern U8 eeprom_read_u32(EE_ADDR log_addr, U32 *value);
+
+/**
+ * @fn U8 eeprom_put(U8 id, const U8 *buf, U8 len)
+ * @brief Store a blob as one record (EE_BLOBS)
+ *
+ * A reset during the write leaves the previous blob.
+ *
+ * @param id blob ID, less than EE_BLOBS.
+ * @param *buf pointer to payload.
+ * @param len payload length, EE_BLOB_MAX or less.
+ *
+ * @return 0: success; 1: error
+ */
+extern U8 eeprom_put(U8 id, const U8 *buf, U8 len);
+
+/**
+ * @fn U8 eeprom_get(U8 id, U8 *buf, U8 maxlen, U8 *len)
+ * @brief Read a blob (EE_BLOBS)
+ *
+ * At most maxlen bytes are copied, a length larger than maxlen means the
+ * blob was truncated. A blob stored with no payload has length 0.
+ *
+ * @param id blob ID, less than EE_BLOBS.
+ * @param *buf pointer to payload buffer.
+ * @param maxlen size of buffer.
+ * @param *len pointer to blob length.
+ *
+ * @return 0: success; 1: error, invalid ID or the blob was never stored
+ */
+extern U8 eeprom_get(U8 id, U8 *buf, U8 maxlen, U8 *len);
+
+/**
+ * @fn U8 eeprom_is_written(EE_ADDR log_addr)
+ * @brief Check whether an address has ever been written
+ *
+ * eeprom_read_byte() returns 0xFF for a never written address, this function
+ * tells it apart from a stored 0xFF value.
+ *
+ * @param log_addr address in eeprom.
+ *
+ * @return TRUE: address holds a written value; FALSE: never written or
+ * address out of range
+ */
+extern U8 eeprom_is_written(EE_ADDR log_addr);
+
+/**
+ * @fn U16 eeprom_get_elided_writes()
+ * @brief Read and clear the number of writes skipped because the value was
+ *  already stored (EE_WRITE_ELIDE)
+ *
+ * @return number of skipped writes
+ */
+extern U16 eeprom_get_elided_writes();
+
+/**
+ * @fn void eeprom_get_lru_stats(U16 *hits, U16 *misses)
+ * @brief Read and clear the read micro cache counters (EE_LRU_ENTRIES)
+ *
+ * @param *hits pointer to number of reads served by the micro cache
+ * @param *misses pointer to number of reads which scanned the page
+ *
+ * @return none
+ */
+extern void eeprom_get_lru_stats(U16 *hits, U16 *misses);
+
+/**
+ * @fn void eeprom_get_wb_stats(U16 *coalesced, U16 *flushed)
+ * @brief Read and clear the write-back buffer counters (EE_WRITE_BACK)
+ *
+ * @param *coalesced pointer to number of writes merged into a pending one
+ * @param *flushed pointer to number of pending writes sent to flash
+ *
+ * @return none
+ */
+extern void eeprom_get_wb_stats(U16 *coalesced, U16 *flushed);
+
+/**
+ * @fn void eeprom_get_wear_stats(U32 *least, U32 *most)
+ * @brief Read the lowest and the highest page erase count
+ *
+ * most - least is the wear spread. It stays within a few erases while wear
+ * is even, the most worn page sets the end of life of the whole area.
+ *
+ * @param *least pointer to erase count of the least worn page
+ * @param *most pointer to erase count of the most worn page
+ *
+ * @return none
+ */
+extern void eeprom_get_wear_stats(U32 *least, U32 *most);
 
 #endif
 
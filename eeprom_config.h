@@ -30,6 +30,32 @@
  */
 #define FL_PAGES        2
 
+/**
+ * @def EE_VPAGE_PAGES
+ * @brief Number of physical Flash pages which form one virtual page. The
+ *  virtual page is the unit of the record log and of compaction: the page
+ *  tag sits in its first physical page, records run on across the others
+ *  and a compaction copies the live values once per EE_VPAGE_PAGES pages of
+ *  records instead of once per page. FL_PAGES must be an integer multiple
+ *  of it and hold two virtual pages at least. 1 gives one page per segment.
+ */
+#define EE_VPAGE_PAGES  1
+
+/**
+ * @def EE_RING_LOG
+ * @brief Set to 1 to use all the pages as one circular record log. A full
+ *  page is followed by the next erased page and the older pages keep their
+ *  records. Only when the last spare page is taken, the values which no
+ *  newer page holds are carried forward from the oldest page and it is
+ *  erased. A value rewritten since costs no copy, so write amplification
+ *  falls about in proportion to the number of pages. Every page stores a
+ *  16 bit sequence number after its tag to tell the oldest from the
+ *  newest. With two pages it behaves like the plain log. It needs
+ *  EE_LAYOUT_LOG, EE_SHADOW_ENABLE and EE_BITMAP_ENABLE, and no
+ *  EE_WIDE_RECORDS, EE_GC_RESERVE or EE_DEFER_ERASE.
+ */
+#define EE_RING_LOG     0
+
 /**
  * @def EE_BASE_ADDR
  * @brief This should point to the memory location where the EEPROM
@@ -41,16 +67,224 @@
 /**
  * @def EE_SIZE
  * @brief Defines how many bytes are in the emulated EEPROM.  The maximum
- *  setting is ((FL_PAGE_SIZE - 4) / 4) & 0xF8. It must be 8 bit align.
+ *  setting is ((EE_PAGE_SIZE - 4) / (2 * EE_VARIABLE_SIZE)) & 0xF8, with
+ *  EE_PAGE_SIZE = FL_PAGE_SIZE * EE_VPAGE_PAGES. EE_RING_LOG and EE_COUNTERS
+ *  add to the 4 bytes page header, EE_LAYOUT_SNAPSHOT and EE_LAYOUT_SLOTS
+ *  have their own limit. It must be 8 bit align.
+ *  Above 248 bytes EE_ADDR16 is needed.
  */
 #define EE_SIZE         16
 
+/**
+ * @def EE_ADDR16
+ * @brief Set to 1 for 16 bit logical addresses, EE_SIZE up to 16384 bytes.
+ *  A record is then 3 bytes: the address 7 bits per byte, high part first,
+ *  and the data. Neither address byte of a record is ever 0xFF, so a blank
+ *  slot is still told by its first byte and a torn address never matches.
+ *  The EE_SIZE maximum still applies, a larger EE_SIZE needs a larger
+ *  EE_VPAGE_PAGES. It needs the C scan loops and no EE_WIDE_RECORDS.
+ */
+#define EE_ADDR16       0
+
 /**
  * @def EE_BITMAP_SIZE
  * @brief Defines bitmap size which equal EE_SIZE/8
  */
 #define EE_BITMAP_SIZE  (EE_SIZE / 8)
 
+/**
+ * @def EE_LAYOUT
+ * @brief Selects how records are laid out in a page.
+ *  EE_LAYOUT_LOG: every value is a 2 bytes (address, data) record appended
+ *  after the tag, compaction rewrites every live value as a record.
+ *  EE_LAYOUT_SNAPSHOT: compaction writes a dense EE_SIZE bytes image (value
+ *  at offset = address) plus a presence bitmap right after the tag, new
+ *  writes append records after the image. Compaction output is half the
+ *  size and reads only scan the short record log before indexing the image.
+ *  The image takes EE_SIZE + EE_BITMAP_SIZE bytes of every page.
+ *  EE_LAYOUT_SLOTS: every address owns a run of EE_SLOTS_PER_ADDR one byte
+ *  slots, a write programs the next erased slot of its own run. No address
+ *  byte is stored and read/write cost is bounded by the run length. The
+ *  page is compacted only when a run is exhausted. Writing 0xFF programs
+ *  the mark byte of the address instead of a slot, a second 0xFF write to
+ *  an address after other values on the same page takes a compaction.
+ */
+#define EE_LAYOUT_LOG       0
+#define EE_LAYOUT_SNAPSHOT  1
+#define EE_LAYOUT_SLOTS     2
+#define EE_LAYOUT           EE_LAYOUT_LOG
+
+/**
+ * @def EE_SLOTS_PER_ADDR
+ * @brief Number of one byte slots owned by each address in EE_LAYOUT_SLOTS.
+ *  EE_SIZE * (EE_SLOTS_PER_ADDR + 1) + EE_TAG_SIZE + 1 must fit in a page,
+ *  plus the counter area of EE_COUNTERS.
+ */
+#define EE_SLOTS_PER_ADDR   8
+
+/**
+ * @def EE_SHADOW_ENABLE
+ * @brief Set to 1 to keep a copy of every emulated EEPROM byte in an EE_SIZE
+ *  bytes XDATA array. eeprom_init() fills it in one pass over the active page
+ *  and eeprom_read_byte() then costs a single array access instead of a
+ *  backward page scan. Set to 0 to keep the zero RAM footprint.
+ */
+#define EE_SHADOW_ENABLE    0
+
+/**
+ * @def EE_BITMAP_ENABLE
+ * @brief Set to 1 to keep an EE_BITMAP_SIZE bytes bitmap of the addresses
+ *  which hold a written value. eeprom_read_byte() returns the erased value
+ *  of a never written address without scanning the page. eeprom_init() then
+ *  reads every record of the active page to fill it. Set to 0 to save the
+ *  RAM, with EE_SHADOW_ENABLE also 0 eeprom_init() finds the write pointer
+ *  of a record log by binary search instead, about 9 reads on a 1024 bytes
+ *  page. It is 0 by default for that faster mount.
+ */
+#define EE_BITMAP_ENABLE    0
+
+/**
+ * @def EE_LRU_ENTRIES
+ * @brief Number of entries in the address to value micro cache which sits
+ *  in front of the page scan of eeprom_read_byte(). It costs two bytes of
+ *  XDATA per entry and is meant for parts which cannot afford the full
+ *  shadow copy. Set to 0 to disable it. eeprom_get_lru_stats() reports the
+ *  hit and miss counts for sizing.
+ */
+#define EE_LRU_ENTRIES      0
+
+/**
+ * @def EE_WRITE_ELIDE
+ * @brief Set to 1 to let eeprom_write_byte() look up the stored value first
+ *  and return without programming flash when it is unchanged. It saves
+ *  records, compactions and erases for applications which re-save whole
+ *  settings blocks. eeprom_get_elided_writes() counts the skipped writes.
+ */
+#define EE_WRITE_ELIDE      1
+
+/**
+ * @def EE_INPLACE_CLEAR
+ * @brief Set to 1 to let eeprom_write_byte() reprogram the data byte of the
+ *  latest record (or slot, or snapshot image byte) when the new value only
+ *  clears bits of it. Flash programs 1 to 0 without an erase, so such
+ *  writes take no new record. Status flags handled by eeprom_clear_bits()
+ *  then never move the write pointer.
+ */
+#define EE_INPLACE_CLEAR    1
+
+/**
+ * @def EE_WIDE_RECORDS
+ * @brief Set to 1 to store the values of eeprom_write_u16() and
+ *  eeprom_write_u32() as one address byte followed by 2 or 4 data bytes,
+ *  and only the changed part of a value. Such a record is programmed data
+ *  first and key last, a reset in between leaves the old value. Records no
+ *  longer have a fixed size, so the log is parsed forward at mount only and
+ *  compaction copies from RAM: it needs EE_LAYOUT_LOG, EE_SHADOW_ENABLE and
+ *  EE_BITMAP_ENABLE, EE_SIZE of 64 or less, and no EE_INPLACE_CLEAR.
+ *  Without it the typed writes need EE_TX_ENABLE.
+ */
+#define EE_WIDE_RECORDS     0
+
+/**
+ * @def EE_BLOBS
+ * @brief Number of blob IDs for eeprom_put() and eeprom_get(), 0 disables
+ *  them. A blob is one record of up to EE_BLOB_MAX bytes, e.g. a device name
+ *  or a small struct. The position of the latest record of every ID is kept
+ *  in XDATA, so a lookup does not scan the page. It needs EE_WIDE_RECORDS.
+ */
+#define EE_BLOBS            0
+#define EE_BLOB_MAX         32
+
+/**
+ * @def EE_COUNTERS
+ * @brief Number of unary counters for eeprom_counter_inc() and
+ *  eeprom_counter_read(), 0 disables them. Every page reserves a 4 bytes
+ *  base value and an EE_COUNTER_BYTES bytes bitfield per counter right after
+ *  the page tag. An increment clears one bit of the bitfield, a full bitfield
+ *  is folded into the base of the next page by a compaction.
+ */
+#define EE_COUNTERS         0
+#define EE_COUNTER_BYTES    8
+
+/**
+ * @def EE_WRITE_BACK
+ * @brief Set to 0 for write-through: eeprom_write_byte() programs flash
+ *  before it returns. Set to 1 for write-back: writes are held in a RAM
+ *  buffer of EE_WB_ENTRIES addresses, a rewrite of a pending address only
+ *  replaces its value. The buffer is programmed by eeprom_flush(), when it
+ *  is full, or by eeprom_tick() after EE_WB_TICKS ticks. Pending values are
+ *  lost on reset, call eeprom_flush() before power down.
+ *  eeprom_get_wb_stats() reports coalesced and flushed writes.
+ */
+#define EE_WRITE_BACK       0
+#define EE_WB_ENTRIES       8
+#define EE_WB_TICKS         10
+
+/**
+ * @def EE_TX_ENABLE
+ * @brief Set to 1 to add eeprom_tx_begin(), eeprom_tx_write() and
+ *  eeprom_tx_commit(). Up to EE_TX_ENTRIES addresses written in a
+ *  transaction become visible together when the commit marker is
+ *  programmed, a reset before that keeps all the old values. Without
+ *  EE_WIDE_RECORDS eeprom_write_u16() and eeprom_write_u32() commit their
+ *  bytes the same way. It needs EE_LAYOUT_LOG or EE_LAYOUT_SNAPSHOT.
+ */
+#define EE_TX_ENABLE        0
+#define EE_TX_ENTRIES       4
+
+/**
+ * @def EE_GC_RESERVE
+ * @brief Number of free records left in the active page when
+ *  eeprom_maintenance() starts an incremental compaction, 0 disables it.
+ *  Each call copies a few live values to the next page while writes keep
+ *  appending to the active page, so the reserve must last until the copy is
+ *  done. A write which finds the page full finishes the copy itself. It
+ *  needs EE_LAYOUT_LOG or EE_LAYOUT_SNAPSHOT without EE_WIDE_RECORDS.
+ */
+#define EE_GC_RESERVE       0
+
+/**
+ * @def EE_DEFER_ERASE
+ * @brief Set to 1 to leave the page a compaction moves away from for
+ *  eeprom_idle_erase(), so the write which triggers a compaction only pays
+ *  for the copy. Such a page keeps its ACTIVE status and gets its last
+ *  record slot programmed, mount tells it from the active page and leaves
+ *  it queued again. A queued page is erased right away when it is the next
+ *  one to receive data, or before the active page fills up.
+ */
+#define EE_DEFER_ERASE      0
+
+/**
+ * @def EE_WEAR_LEVEL
+ * @brief Set to 1 to pick the destination of a compaction by erase count:
+ *  the page with the lowest count in its tag other than the active one,
+ *  the next page in turn on a tie. Taking pages in turn spreads new wear
+ *  evenly, this also evens out pages which were worn unevenly before, e.g.
+ *  by an earlier FL_PAGES setting. Counts are cached in XDATA at mount, 4
+ *  bytes per page. The ring log of EE_RING_LOG takes its pages in turn, it
+ *  cannot be combined.
+ */
+#define EE_WEAR_LEVEL       0
+
+/**
+ * @def EE_FAST_MOUNT
+ * @brief Set to 1 to skip the blank check of ERASED pages in eeprom_init().
+ *  A spare page is verified right before it receives data instead, and
+ *  eeprom_verify() runs the full check on demand. It saves up to
+ *  (FL_PAGES - 1) * (FL_PAGE_SIZE - EE_TAG_SIZE) code space reads per boot.
+ */
+#define EE_FAST_MOUNT       0
+
+/**
+ * @def EE_ASM_KERNELS
+ * @brief Set to 1 to use assembly loops for the page scans: record lookup,
+ *  write pointer search and blank check. Keil C51 uses flash_asm.a51, set
+ *  SET(EE_ASM_KERNELS=1) in the assembler flags of the project too. SDCC uses inline assembly in flash.c and
+ *  needs the small memory model. Other compilers keep the C loops, which also switch the
+ *  program bank once per scan.
+ */
+#define EE_ASM_KERNELS      0
+
 /**
  * @def RSTSRC_VAL
  * @brief This should be configured to enable the appropriate reset
@@ -62,6 +296,72 @@
 #error "Invalid EE_SIZE.  Select an integer multiple of 8."
 #endif
 
+#if !EE_ADDR16 && (EE_SIZE > 248)
+#error "Invalid EE_SIZE.  Select 248 or less, or set EE_ADDR16."
+#endif
+
+#if EE_ADDR16 && (EE_SIZE > 16384)
+#error "Invalid EE_SIZE.  Select 16384 or less."
+#endif
+
+#if EE_ADDR16 && (EE_WIDE_RECORDS || EE_ASM_KERNELS)
+#error "EE_ADDR16 needs EE_WIDE_RECORDS and EE_ASM_KERNELS to be 0."
+#endif
+
+#if EE_SHADOW_ENABLE && EE_LRU_ENTRIES
+#error "EE_LRU_ENTRIES is useless with EE_SHADOW_ENABLE. Select one of them."
+#endif
+
+#if EE_LRU_ENTRIES > 16
+#error "Invalid EE_LRU_ENTRIES.  Select 16 or less."
+#endif
+
+#if EE_WRITE_BACK && ((EE_WB_ENTRIES == 0) || (EE_WB_ENTRIES > EE_SIZE))
+#error "Invalid EE_WB_ENTRIES.  Select 1 to EE_SIZE."
+#endif
+
+#if EE_TX_ENABLE && (EE_LAYOUT == EE_LAYOUT_SLOTS)
+#error "EE_TX_ENABLE needs EE_LAYOUT_LOG or EE_LAYOUT_SNAPSHOT."
+#endif
+
+#if EE_TX_ENABLE && ((EE_TX_ENTRIES == 0) || (EE_TX_ENTRIES > 16))
+#error "Invalid EE_TX_ENTRIES.  Select 1 to 16."
+#endif
+
+#if EE_GC_RESERVE && ((EE_LAYOUT == EE_LAYOUT_SLOTS) || EE_WIDE_RECORDS)
+#error "EE_GC_RESERVE needs EE_LAYOUT_LOG or EE_LAYOUT_SNAPSHOT without EE_WIDE_RECORDS."
+#endif
+
+#if EE_RING_LOG && ((EE_LAYOUT != EE_LAYOUT_LOG) || !EE_SHADOW_ENABLE || \
+	!EE_BITMAP_ENABLE || EE_WIDE_RECORDS || EE_GC_RESERVE || EE_DEFER_ERASE)
+#error "EE_RING_LOG needs EE_LAYOUT_LOG, EE_SHADOW_ENABLE and EE_BITMAP_ENABLE without EE_WIDE_RECORDS, EE_GC_RESERVE and EE_DEFER_ERASE."
+#endif
+
+#if EE_WEAR_LEVEL && EE_RING_LOG
+#error "EE_WEAR_LEVEL cannot be used with EE_RING_LOG."
+#endif
+
+#if EE_COUNTERS && ((EE_COUNTER_BYTES == 0) || (EE_COUNTER_BYTES > 32))
+#error "Invalid EE_COUNTER_BYTES.  Select 1 to 32."
+#endif
+
+#if EE_WIDE_RECORDS && ((EE_LAYOUT != EE_LAYOUT_LOG) || !EE_SHADOW_ENABLE || \
+	!EE_BITMAP_ENABLE || EE_INPLACE_CLEAR)
+#error "EE_WIDE_RECORDS needs EE_LAYOUT_LOG, EE_SHADOW_ENABLE and EE_BITMAP_ENABLE without EE_INPLACE_CLEAR."
+#endif
+
+#if EE_WIDE_RECORDS && (EE_SIZE > 64)
+#error "Invalid EE_SIZE.  Select 64 or less with EE_WIDE_RECORDS."
+#endif
+
+#if EE_BLOBS && !EE_WIDE_RECORDS
+#error "EE_BLOBS needs EE_WIDE_RECORDS."
+#endif
+
+#if EE_BLOBS && (EE_BLOB_MAX > 252)
+#error "Invalid EE_BLOB_MAX.  Select 252 or less."
+#endif
+
 #if (EE_BASE_ADDR % FL_PAGE_SIZE) != 0
 #error "Invalid EE_BASE_ADDR.  Select an integer multiple of FL_PAGE_SIZE."
 #endif
@@ -70,6 +370,11 @@
 #error "Defined EE Area not possible.  Reduce EE_BASE_ADDR or FL_PAGES."
 #endif
 
+#if (EE_VPAGE_PAGES == 0) || ((FL_PAGES % EE_VPAGE_PAGES) != 0) || \
+	(FL_PAGES < 2 * EE_VPAGE_PAGES)
+#error "Invalid EE_VPAGE_PAGES.  FL_PAGES must hold two or more virtual pages."
+#endif
+
 
 /**
  * The following should not normally need to be edited, unless the guts of the
@@ -79,7 +384,129 @@
 #define EE_TOP_ADDR     EE_BASE_ADDR + (FL_PAGES*FL_PAGE_SIZE) - 1
 #define EE_TAG_SIZE     4    // Number of bytes used for tag info
 
+/* Virtual page, every layout offset below is relative to its first byte*/
+#define EE_PAGE_SIZE    (FL_PAGE_SIZE * EE_VPAGE_PAGES)
+#define EE_PAGES        (FL_PAGES / EE_VPAGE_PAGES)
+
+/* Logical address type, the all ones value marks no address*/
+#if EE_ADDR16
+typedef U16 EE_ADDR;
+#else
+typedef U8 EE_ADDR;
+#endif
+#define EE_ADDR_NONE        ((EE_ADDR)~0)
+
+/* Record is the address key then the data byte*/
+#if EE_ADDR16
+#define EE_VARIABLE_SIZE    3
+#else
 #define EE_VARIABLE_SIZE    2
+#endif
+#define EE_DATA_OFFSET      (EE_VARIABLE_SIZE - 1)
+
+/* Replaced pages are queued for a later erase, by EE_DEFER_ERASE or by the
+ * erase step of the incremental compaction*/
+#define EE_ERASE_QUEUE      (EE_DEFER_ERASE || EE_GC_RESERVE)
+
+/* Page sequence number of EE_RING_LOG follows the tag, MSB first*/
+#define EE_SEQ_OFFSET       EE_TAG_SIZE
+#if EE_RING_LOG
+#define EE_SEQ_SIZE         2
+#else
+#define EE_SEQ_SIZE         0
+#endif
+
+/* Counter area follows the tag, inverted U32 base then bitfield per counter*/
+#define EE_COUNTER_AREA     (EE_SEQ_OFFSET + EE_SEQ_SIZE)
+#define EE_COUNTER_SIZE     (4 + EE_COUNTER_BYTES)
+#define EE_HEAD_SIZE        (EE_COUNTER_AREA + EE_COUNTERS * EE_COUNTER_SIZE)
+
+/* Snapshot image position within a page, presence bitmap then data*/
+#define EE_IMAGE_MAP        EE_HEAD_SIZE
+#define EE_IMAGE_DATA       (EE_IMAGE_MAP + EE_BITMAP_SIZE)
+
+/* Slot layout, seal byte is programmed on a page which is being replaced.
+ * Mark byte per address holds the number of used slots when 0xFF was written*/
+#define EE_SLOT_SEAL        EE_HEAD_SIZE
+#define EE_SLOT_MARKS       (EE_SLOT_SEAL + 1)
+#define EE_SLOT_BASE        (EE_SLOT_MARKS + EE_SIZE)
+
+#if (EE_LAYOUT == EE_LAYOUT_SLOTS) && \
+	((EE_SLOT_BASE + EE_SIZE * EE_SLOTS_PER_ADDR) > EE_PAGE_SIZE)
+#error "Invalid EE_SLOTS_PER_ADDR.  Runs do not fit in a page."
+#endif
+
+/* Record log boundaries within a page, EE_LOG_END is the end of last slot*/
+#if EE_LAYOUT == EE_LAYOUT_SNAPSHOT
+#define EE_LOG_START        (EE_IMAGE_DATA + EE_SIZE)
+#else
+#define EE_LOG_START        EE_HEAD_SIZE
+#endif
+#if EE_WIDE_RECORDS
+/* Records have no fixed size, last byte of page seals a page being replaced*/
+#define EE_LOG_SEAL         (EE_PAGE_SIZE - 1)
+#define EE_LOG_END          EE_LOG_SEAL
+#else
+#define EE_LOG_END          (EE_LOG_START + \
+	((EE_PAGE_SIZE - EE_LOG_START) / EE_VARIABLE_SIZE) * EE_VARIABLE_SIZE)
+#endif
+
+/* Record keys of EE_WIDE_RECORDS, low 6 bits are the first address*/
+#define EE_KEY_U16          0x40
+#define EE_KEY_U32          0x80
+/* Covers the data of a torn record, low 3 bits are the number of bytes*/
+#define EE_KEY_PAD          0xC0
+/* Blob record is key, ID, length and payload. It is programmed with the
+ * open key and committed by clearing bit 0 of it*/
+#define EE_KEY_BLOB         0xD0
+#define EE_KEY_BLOB_OPEN    0xD1
+#define EE_BLOB_HEAD        3
+
+/* A compacted page must hold every value, every blob and one more blob*/
+#if EE_BLOBS && ((EE_LOG_START + 2 * EE_SIZE + \
+	(EE_BLOBS + 1) * (EE_BLOB_HEAD + EE_BLOB_MAX)) > EE_LOG_END)
+#error "Invalid EE_BLOBS or EE_BLOB_MAX.  Blobs do not fit in a page."
+#endif
+
+/* Key of the record which opens a transaction, its data is the commit marker*/
+#define EE_TX_BEGIN         ((EE_ADDR)(EE_ADDR_NONE - 1))
+/* Records of the largest transaction, eeprom_write_u32() commits 4 bytes*/
+#if EE_TX_ENTRIES < 4
+#define EE_TX_GROUP         4
+#else
+#define EE_TX_GROUP         EE_TX_ENTRIES
+#endif
+
+/* A compacted page must hold a whole transaction after the live records*/
+#if EE_TX_ENABLE && (EE_LAYOUT == EE_LAYOUT_LOG) && \
+	((EE_SIZE + EE_TX_GROUP + 1) * EE_VARIABLE_SIZE > (EE_LOG_END - EE_LOG_START))
+#error "Invalid EE_TX_ENTRIES.  A transaction does not fit in a compacted page."
+#endif
+#if EE_TX_ENABLE && (EE_LAYOUT == EE_LAYOUT_SNAPSHOT) && \
+	((EE_TX_GROUP + 1) * EE_VARIABLE_SIZE > (EE_LOG_END - EE_LOG_START))
+#error "Invalid EE_TX_ENTRIES.  A transaction does not fit in a compacted page."
+#endif
+
+#if (EE_LOG_START + 2 * EE_VARIABLE_SIZE) > EE_PAGE_SIZE
+#error "Invalid EE_SIZE.  Snapshot image leaves no room for records."
+#endif
+
+/* Live values take at most half of the log, the other half takes new writes*/
+#if (EE_LAYOUT == EE_LAYOUT_LOG) && \
+	(EE_SIZE > (((EE_PAGE_SIZE - EE_LOG_START) / (2 * EE_VARIABLE_SIZE)) & 0xF8))
+#error "Invalid EE_SIZE.  Select ((EE_PAGE_SIZE - 4) / (2 * EE_VARIABLE_SIZE)) & 0xF8 or less."
+#endif
+
+/* A page compacted incrementally holds the writes made meanwhile, it must
+ * still have the reserve free so the next compaction does not start at once*/
+#if EE_GC_RESERVE && (EE_LAYOUT == EE_LAYOUT_LOG) && \
+	((EE_SIZE + 2 * EE_GC_RESERVE) * EE_VARIABLE_SIZE > (EE_LOG_END - EE_LOG_START))
+#error "Invalid EE_GC_RESERVE.  A compacted page does not keep the reserve free."
+#endif
+#if EE_GC_RESERVE && (EE_LAYOUT == EE_LAYOUT_SNAPSHOT) && \
+	(2 * EE_GC_RESERVE * EE_VARIABLE_SIZE > (EE_LOG_END - EE_LOG_START))
+#error "Invalid EE_GC_RESERVE.  A compacted page does not keep the reserve free."
+#endif
 
 #define SUCCESS 0x00
 #define ERROR   0x01
@@ -29,6 +29,109 @@ SEGMENT_VARIABLE(flashAddress, U16, SEG_DATA) = FLASH_SAFE_ADDR;
 #define FL_WRITE        0x01        // PSCTL mask for Flash Writes
 #define FL_ERASE        0x03        // PSCTL mask for Flash Erase
 
+/* Scan kernels, they run with program bank already switched*/
+#if EE_ASM_KERNELS && defined __C51__
+/* Implemented in flash_asm.a51*/
+extern U16 flash_find_back_kernel(U16 from, U16 to, U8 key);
+extern U16 flash_find_fwd_kernel(U16 from, U16 end, U8 key);
+extern U8 flash_is_blank_kernel(U16 from, U16 len);
+#define FL_ASM_KERNELS  1
+#elif EE_ASM_KERNELS && defined SDCC && defined SDCC_MODEL_SMALL
+/* Same loops as flash_asm.a51, parameters 2 and 3 are passed in data memory*/
+static U16 flash_find_back_kernel(U16 from, U16 to, U8 key) __naked
+{
+	from; to; key;
+	__asm
+	mov	r4,(_flash_find_back_kernel_PARM_2 + 1)
+	mov	r5,_flash_find_back_kernel_PARM_2
+	mov	r3,_flash_find_back_kernel_PARM_3
+00001$:
+	clr	c
+	mov	a,dpl
+	subb	a,r5
+	mov	a,dph
+	subb	a,r4
+	jc	00003$
+	clr	a
+	movc	a,@a+dptr
+	xrl	a,r3
+	jz	00002$
+	mov	a,dpl
+	clr	c
+	subb	a,#2
+	mov	dpl,a
+	jnc	00001$
+	dec	dph
+	sjmp	00001$
+00003$:
+	mov	dpl,#0
+	mov	dph,#0
+00002$:
+	ret
+	__endasm;
+}
+
+static U16 flash_find_fwd_kernel(U16 from, U16 end, U8 key) __naked
+{
+	from; end; key;
+	__asm
+	mov	r4,(_flash_find_fwd_kernel_PARM_2 + 1)
+	mov	r5,_flash_find_fwd_kernel_PARM_2
+	mov	r3,_flash_find_fwd_kernel_PARM_3
+00001$:
+	clr	c
+	mov	a,dpl
+	subb	a,r5
+	mov	a,dph
+	subb	a,r4
+	jnc	00003$
+	clr	a
+	movc	a,@a+dptr
+	xrl	a,r3
+	jz	00002$
+	inc	dptr
+	inc	dptr
+	sjmp	00001$
+00003$:
+	mov	dpl,r5
+	mov	dph,r4
+00002$:
+	ret
+	__endasm;
+}
+
+static U8 flash_is_blank_kernel(U16 from, U16 len) __naked
+{
+	from; len;
+	__asm
+	mov	r4,(_flash_is_blank_kernel_PARM_2 + 1)
+	mov	r5,_flash_is_blank_kernel_PARM_2
+	mov	a,r5
+	orl	a,r4
+	jz	00003$
+	mov	a,r5
+	jz	00001$
+	inc	r4
+00001$:
+	clr	a
+	movc	a,@a+dptr
+	cjne	a,#0xFF,00004$
+	inc	dptr
+	djnz	r5,00001$
+	djnz	r4,00001$
+00003$:
+	mov	dpl,#1
+	ret
+00004$:
+	mov	dpl,#0
+	ret
+	__endasm;
+}
+#define FL_ASM_KERNELS  1
+#else
+#define FL_ASM_KERNELS  0
+#endif
+
 /**
  * @fn static void flash_setup_key(U8 key1, U8 key2, U16 address)
  * @brief Setup flash key1, key2 and address
@@ -106,6 +209,57 @@ U8 flash_read_byte(U16 address)
 	return dat;
 }
 
+U16 flash_find_back(U16 from, U16 to, U8 key)
+{
+	PSBANK_STORE()
+	PSBANK_SWITCH()
+#if FL_ASM_KERNELS
+	from = flash_find_back_kernel(from, to, key);
+#else
+	while ((from >= to) && (*((U8 SEG_CODE *) from) != key))
+		from -= EE_VARIABLE_SIZE;
+	if (from < to)
+		from = 0;
+#endif
+	PSBANK_RESTORE()
+	return from;
+}
+
+U16 flash_find_fwd(U16 from, U16 end, U8 key)
+{
+	PSBANK_STORE()
+	PSBANK_SWITCH()
+#if FL_ASM_KERNELS
+	from = flash_find_fwd_kernel(from, end, key);
+#else
+	while ((from < end) && (*((U8 SEG_CODE *) from) != key))
+		from += EE_VARIABLE_SIZE;
+	if (from > end)
+		from = end;
+#endif
+	PSBANK_RESTORE()
+	return from;
+}
+
+U8 flash_is_blank(U16 from, U16 len)
+{
+	U8 ret = TRUE;
+	PSBANK_STORE()
+	PSBANK_SWITCH()
+#if FL_ASM_KERNELS
+	ret = flash_is_blank_kernel(from, len);
+#else
+	for (; len; len--) {
+		if (*((U8 SEG_CODE *) from++) != 0xFF) {
+			ret = FALSE;
+			break;
+		}
+	}
+#endif
+	PSBANK_RESTORE()
+	return ret;
+}
+
 //-----------------------------------------------------------------------------
 // End Of File
 //-----------------------------------------------------------------------------
@@ -47,6 +47,45 @@ extern void flash_write_byte(U16 address, U8 dat);
  */
 extern U8 flash_read_byte(U16 address);
 
+/**
+ * @fn U16 flash_find_back(U16 from, U16 to, U8 key)
+ * @brief Scan records backward for the first one starting with key
+ *
+ * Bank is switched once for the whole scan, EE_ASM_KERNELS selects an
+ * assembly loop.
+ *
+ * @param from physical address of the first record to check
+ * @param to physical address of the last record to check, lowest one
+ * @param key byte to look for in the first byte of a record
+ *
+ * @return physical address of the record found, 0 if none. Address 0 is the
+ * reset vector, it is never part of the eeprom area.
+ */
+extern U16 flash_find_back(U16 from, U16 to, U8 key);
+
+/**
+ * @fn U16 flash_find_fwd(U16 from, U16 end, U8 key)
+ * @brief Scan records forward for the first one starting with key
+ *
+ * @param from physical address of the first record to check
+ * @param end physical address after the last record to check
+ * @param key byte to look for in the first byte of a record
+ *
+ * @return physical address of the record found, end if none
+ */
+extern U16 flash_find_fwd(U16 from, U16 end, U8 key);
+
+/**
+ * @fn U8 flash_is_blank(U16 from, U16 len)
+ * @brief Check a flash range is erased
+ *
+ * @param from physical address of the range
+ * @param len number of bytes in the range
+ *
+ * @return TRUE: every byte is 0xFF; FALSE: range is not blank
+ */
+extern U8 flash_is_blank(U16 from, U16 len);
+
 #endif
 
 //-----------------------------------------------------------------------------